@@ -610,11 +610,16 @@ void MainWindow::onTrackRequested(const QString &trackName)
 	QObject::connect(t, SIGNAL(keyFrameRemoved(int, const SyncTrack::TrackKey &)),
 	                 syncClient, SLOT(onKeyFrameRemoved(int, const SyncTrack::TrackKey &)));
 
-	// send key frames
+	// send key frames, unless the client still has the same ones
 	QMap<int, SyncTrack::TrackKey> keyMap = t->getKeyMap();
-	QMap<int, SyncTrack::TrackKey>::const_iterator it;
-	for (it = keyMap.constBegin(); it != keyMap.constEnd(); ++it)
-		syncClient->sendSetKeyCommand(t->getName(), *it);
+	if (!syncClient->clientHasSameKeys(trackName, keyMap.size(), t->getKeyHash())) {
+		if (syncClient->clientHasKeys(trackName))
+			syncClient->sendClearTrackCommand(t->getName());
+
+		QMap<int, SyncTrack::TrackKey>::const_iterator it;
+		for (it = keyMap.constBegin(); it != keyMap.constEnd(); ++it)
+			syncClient->sendSetKeyCommand(t->getName(), *it);
+	}
 
 	t->setActive(true);
 }
@@ -640,12 +645,13 @@ void MainWindow::onNewTcpConnection()
 		setStatusText("Accepting...");
 
 		QByteArray greeting = QString(CLIENT_GREET).toUtf8();
+		QByteArray greetingHashes = QString(CLIENT_GREET_HASHES).toUtf8();
 		QByteArray response = QString(SERVER_GREET).toUtf8();
 
 		if (pendingSocket->bytesAvailable() < 1)
 			pendingSocket->waitForReadyRead();
 		QByteArray line = pendingSocket->read(greeting.length());
-		if (line != greeting ||
+		if ((line != greeting && line != greetingHashes) ||
 		    pendingSocket->write(response) != response.length()) {
 			pendingSocket->close();
 
@@ -653,6 +659,9 @@ void MainWindow::onNewTcpConnection()
 			return;
 		}
 
+		// track data is answered in bursts, don't let Nagle hold it back
+		pendingSocket->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+
 		SyncClient *client = new AbstractSocketClient(pendingSocket);
 
 		connect(client, SIGNAL(trackRequested(const QString &)), this, SLOT(onTrackRequested(const QString &)));
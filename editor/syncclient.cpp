@@ -67,6 +67,19 @@ void SyncClient::sendSaveCommand()
 	sendData(data);
 }
 
+void SyncClient::sendClearTrackCommand(const QString &trackName)
+{
+	int trackIndex = trackNames.indexOf(trackName);
+	if (trackIndex < 0)
+		return;
+
+	QByteArray data;
+	QDataStream ds(&data, QIODevice::WriteOnly);
+	ds << (unsigned char)CLEAR_TRACK;
+	ds << (quint32)trackIndex;
+	sendData(data);
+}
+
 void SyncClient::setPaused(bool pause)
 {
 	if (pause != paused) {
@@ -81,6 +94,12 @@ void SyncClient::requestTrack(const QString &trackName)
 	emit trackRequested(trackName);
 }
 
+void SyncClient::requestTrack(const QString &trackName, int count, quint32 hash)
+{
+	clientKeys.insert(trackName, qMakePair(count, hash));
+	requestTrack(trackName);
+}
+
 bool AbstractSocketClient::recv(char *buffer, qint64 length)
 {
 	// wait for enough data to arrive
@@ -101,7 +120,11 @@ void AbstractSocketClient::processCommand()
 	if (recv((char*)&cmd, 1)) {
 		switch (cmd) {
 		case GET_TRACK:
-			processGetTrack();
+			processGetTrack(false);
+			break;
+
+		case GET_TRACK_HASH:
+			processGetTrack(true);
 			break;
 
 		case SET_ROW:
@@ -111,7 +134,7 @@ void AbstractSocketClient::processCommand()
 	}
 }
 
-void AbstractSocketClient::processGetTrack()
+void AbstractSocketClient::processGetTrack(bool withHash)
 {
 	// read data
 	quint32 strLen;
@@ -135,7 +158,17 @@ void AbstractSocketClient::processGetTrack()
 		return;
 	}
 
-	requestTrack(QString::fromUtf8(trackNameBuffer));
+	if (withHash) {
+		quint32 count, hash;
+		if (!recv((char *)&count, sizeof(count)) ||
+		    !recv((char *)&hash, sizeof(hash))) {
+			close();
+			return;
+		}
+		requestTrack(QString::fromUtf8(trackNameBuffer),
+		    qFromBigEndian(count), qFromBigEndian(hash));
+	} else
+		requestTrack(QString::fromUtf8(trackNameBuffer));
 }
 
 void AbstractSocketClient::processSetRow()
@@ -178,7 +211,7 @@ void WebSocketClient::processTextMessage(const QString &message)
 	QObject::disconnect(socket, SIGNAL(textMessageReceived(const QString &)), this, SLOT(processTextMessage(const QString &)));
 
 	QByteArray response = QString(SERVER_GREET).toUtf8();
-	if (message != CLIENT_GREET ||
+	if ((message != CLIENT_GREET && message != CLIENT_GREET_HASHES) ||
 		sendData(response) != response.length()) {
 		socket->close();
 	} else {
@@ -204,6 +237,18 @@ void WebSocketClient::onMessageReceived(const QByteArray &data)
 	}
 	break;
 
+	case GET_TRACK_HASH:
+	{
+		quint32 length, count, hash;
+		ds >> length;
+		Q_ASSERT(1 + sizeof(length) + length + 8 == size_t(data.length()));
+		QByteArray nameData(data.constData() + 1 + sizeof(length), length);
+		ds.skipRawData(length);
+		ds >> count >> hash;
+		requestTrack(QString::fromUtf8(nameData), count, hash);
+	}
+	break;
+
 	case SET_ROW:
 	{
 		quint32 row;
@@ -9,6 +9,7 @@
 #include "synctrack.h"
 
 #define CLIENT_GREET "hello, synctracker!"
+#define CLIENT_GREET_HASHES "hello, synctracker?" // knows GET_TRACK_HASH
 #define SERVER_GREET "hello, demo!"
 
 enum {
@@ -17,7 +18,9 @@ enum {
 	GET_TRACK = 2,
 	SET_ROW = 3,
 	PAUSE = 4,
-	SAVE_TRACKS = 5
+	SAVE_TRACKS = 5,
+	GET_TRACK_HASH = 6,
+	CLEAR_TRACK = 7
 };
 
 class SyncClient : public QObject {
@@ -33,9 +36,17 @@ public:
 	void sendDeleteKeyCommand(const QString &trackName, int row);
 	void sendSetRowCommand(int row);
 	void sendSaveCommand();
+	void sendClearTrackCommand(const QString &trackName);
 
 	const QStringList getTrackNames() { return trackNames; }
 	bool isPaused() { return paused; }
+
+	// a GET_TRACK_HASH tells which keys the client already holds
+	bool clientHasKeys(const QString &trackName) const { return clientKeys.contains(trackName); }
+	bool clientHasSameKeys(const QString &trackName, int count, quint32 hash) const
+	{
+		return clientKeys.value(trackName, qMakePair(-1, 0u)) == qMakePair(count, hash);
+	}
 	void setPaused(bool);
 
 signals:
@@ -71,9 +82,11 @@ protected slots:
 
 protected:
 	void requestTrack(const QString &trackName);
+	void requestTrack(const QString &trackName, int count, quint32 hash);
 	void sendPauseCommand(bool pause);
 
 	QList<QString> trackNames;
+	QMap<QString, QPair<int, quint32> > clientKeys;
 	bool paused;
 };
 
@@ -105,7 +118,7 @@ private:
 	bool recv(char *buffer, qint64 length);
 
 	void processCommand();
-	void processGetTrack();
+	void processGetTrack(bool withHash);
 	void processSetRow();
 
 private slots:
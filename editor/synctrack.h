@@ -3,6 +3,7 @@
 
 #include <QObject>
 #include <QMap>
+#include <QtEndian>
 
 class SyncTrack : public QObject {
 	Q_OBJECT
@@ -151,6 +152,30 @@ public:
 		return keys;
 	}
 
+	// FNV-1a over the keys as SET_KEY sends them, like the client library
+	quint32 getKeyHash() const
+	{
+		quint32 hash = 2166136261u;
+		QMap<int, TrackKey>::const_iterator it;
+		for (it = keys.constBegin(); it != keys.constEnd(); ++it) {
+			union {
+				float f;
+				quint32 i;
+			} v;
+			v.f = it->value;
+
+			unsigned char key[9];
+			qToBigEndian((quint32)it->row, key);
+			qToBigEndian(v.i, key + 4);
+			key[8] = (unsigned char)it->type;
+			for (int i = 0; i < 9; ++i) {
+				hash ^= key[i];
+				hash *= 16777619u;
+			}
+		}
+		return hash;
+	}
+
 	bool isActive() const
 	{
 		return active;
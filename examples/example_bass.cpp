@@ -168,8 +168,9 @@ int main(int argc, char *argv[])
 		die("out of memory?");
 
 #ifndef SYNC_PLAYER
-	if (sync_connect(rocket, "localhost", SYNC_DEFAULT_PORT))
-		die("failed to connect to host");
+	/* sync_update connects, and reconnects if the editor goes away */
+	if (sync_connect_async(rocket, "localhost", SYNC_DEFAULT_PORT))
+		die("out of memory?");
 #endif
 
 	/* get tracks */
@@ -187,8 +188,7 @@ int main(int argc, char *argv[])
 	while (!done) {
 		double row = bass_get_row(stream);
 #ifndef SYNC_PLAYER
-		if (sync_update(rocket, (int)floor(row), &bass_cb, (void *)&stream))
-			sync_connect(rocket, "localhost", SYNC_DEFAULT_PORT);
+		sync_update(rocket, (int)floor(row), &bass_cb, (void *)&stream);
 #endif
 
 		/* draw */
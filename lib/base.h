@@ -24,12 +24,27 @@
   #define snprintf _snprintf
  #endif
  /* int is 32-bit for both x86 and x64 */
+ typedef int int32_t;
  typedef unsigned int uint32_t;
  #define UINT32_MAX UINT_MAX
 #elif defined(__GNUC__)
  #include <stdint.h>
 #elif defined(M68000)
+ typedef int int32_t;
  typedef unsigned int uint32_t;
 #endif
 
+/* configure access to what is shared with other threads */
+#ifdef _MSC_VER
+ /* volatile accesses have acquire and release semantics here */
+ #define load_acquire(p) (*(p))
+ #define store_release(p, v) (*(p) = (v))
+#elif defined(__GNUC__)
+ #define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+ #define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#else
+ #define load_acquire(p) (*(p))
+ #define store_release(p, v) (*(p) = (v))
+#endif
+
 #endif /* SYNC_BASE_H */
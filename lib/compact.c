@@ -0,0 +1,422 @@
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+
+#include "compact.h"
+
+/*
+ * An encoded track is a varint key count, followed by the first row as
+ * a zigzag varint and the distance to each next row minus one, then the
+ * key types packed four to a byte, and finally the values in one of the
+ * encodings below.
+ */
+enum {
+	VALUES_RAW,     /* native floats */
+	VALUES_FIXED,   /* shift, zigzag varint deltas of value << shift */
+	VALUES_PALETTE  /* palette size, native floats, one byte per key */
+};
+
+#define FIXED_MAX_SHIFT 20
+#define FIXED_LIMIT (1 << 30) /* keeps deltas within 32 bits */
+#define PALETTE_MAX 256
+
+static inline uint32_t zigzag(int32_t v)
+{
+	return v < 0 ? ((uint32_t)~v << 1) | 1 : (uint32_t)v << 1;
+}
+
+static inline int32_t unzigzag(uint32_t v)
+{
+	return v & 1 ? ~(int32_t)(v >> 1) : (int32_t)(v >> 1);
+}
+
+static const unsigned char *get_varint(const unsigned char *src,
+    const unsigned char *end, uint32_t *v)
+{
+	int shift;
+	*v = 0;
+	for (shift = 0; shift < 35 && src < end; shift += 7) {
+		*v |= (uint32_t)(*src & 0x7f) << shift;
+		if (!(*src++ & 0x80))
+			return src;
+	}
+	return NULL;
+}
+
+/* decode into keys the caller allocated, and update their polynomials */
+int sync_expand_keys(struct sync_track *t, const unsigned char *src,
+    size_t size)
+{
+	const unsigned char *end = src + size;
+	uint32_t n, v;
+	int i;
+
+	src = get_varint(src, end, &n);
+	if (!src || n != (uint32_t)t->num_keys)
+		return -1;
+	if (!n)
+		return 0;
+
+	/* rows */
+	if (!(src = get_varint(src, end, &v)))
+		return -1;
+	t->rows[0] = unzigzag(v);
+	for (i = 1; i < (int)n; ++i) {
+		if (!(src = get_varint(src, end, &v)) ||
+		    v >= (uint32_t)INT_MAX - (uint32_t)t->rows[i - 1])
+			return -1;
+		t->rows[i] = (int)((uint32_t)t->rows[i - 1] + v + 1);
+	}
+
+	/* types, every 2-bit pattern is a valid key type */
+	if ((size_t)(end - src) < (n + 3) / 4 + 1)
+		return -1;
+	for (i = 0; i < (int)n; ++i)
+		t->types[i] = (src[i >> 2] >> ((i & 3) * 2)) & 3;
+	src += (n + 3) / 4;
+
+	switch (*src++) {
+	case VALUES_RAW:
+		if ((size_t)(end - src) < sizeof(float) * n)
+			return -1;
+		memcpy(t->values, src, sizeof(float) * n);
+		src += sizeof(float) * n;
+		break;
+
+	case VALUES_FIXED: {
+		double scale;
+		int32_t x = 0;
+		if (src == end || *src > FIXED_MAX_SHIFT)
+			return -1;
+		scale = 1.0 / (1 << *src++);
+		for (i = 0; i < (int)n; ++i) {
+			if (!(src = get_varint(src, end, &v)))
+				return -1;
+			x = (int32_t)((uint32_t)x + (uint32_t)unzigzag(v));
+			t->values[i] = (float)(x * scale);
+		}
+		break;
+	}
+
+	case VALUES_PALETTE: {
+		const unsigned char *palette;
+		unsigned int count;
+		if (src == end)
+			return -1;
+		count = *src++ + 1;
+		if ((size_t)(end - src) < sizeof(float) * count + n)
+			return -1;
+		palette = src;
+		src += sizeof(float) * count;
+		for (i = 0; i < (int)n; ++i) {
+			if (src[i] >= count)
+				return -1;
+			memcpy(t->values + i, palette + sizeof(float) * src[i],
+			    sizeof(float));
+		}
+		src += n;
+		break;
+	}
+
+	default:
+		return -1;
+	}
+
+	if (src != end)
+		return -1;
+
+	sync_update_polys(t, 0, t->num_keys);
+	return 0;
+}
+
+/*
+ * The LZ stage is a stream of sequences: a token byte with the literal
+ * count in the high nibble and the match length minus LZ_MIN_MATCH in the
+ * low nibble, either extended by bytes of 255 and a final byte when it is
+ * 15, the literals, and a 16-bit little-endian match offset. The last
+ * sequence only has literals.
+ */
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+static const unsigned char *lz_get_length(const unsigned char *src,
+    const unsigned char *end, size_t *len)
+{
+	unsigned char b;
+	if (*len != 15)
+		return src;
+	do {
+		if (src == end)
+			return NULL;
+		b = *src++;
+		*len += b;
+	} while (b == 255);
+	return src;
+}
+
+size_t sync_lz_decompress(const unsigned char *src, size_t size,
+    unsigned char *dst, size_t max)
+{
+	const unsigned char *end = src + size;
+	unsigned char *op = dst, *oend = dst + max;
+
+	while (src < end) {
+		unsigned int token = *src++;
+		size_t len = token >> 4, offset;
+		const unsigned char *match;
+
+		if (!(src = lz_get_length(src, end, &len)) ||
+		    (size_t)(end - src) < len || (size_t)(oend - op) < len)
+			return 0;
+		memcpy(op, src, len);
+		op += len;
+		src += len;
+		if (src == end)
+			break;
+
+		if (end - src < 2)
+			return 0;
+		offset = src[0] | (size_t)src[1] << 8;
+		src += 2;
+		len = token & 15;
+		if (!offset || offset > (size_t)(op - dst) ||
+		    !(src = lz_get_length(src, end, &len)))
+			return 0;
+		len += LZ_MIN_MATCH;
+		if ((size_t)(oend - op) < len)
+			return 0;
+
+		/* matches may overlap their own output */
+		for (match = op - offset; len--; )
+			*op++ = *match++;
+	}
+	return op - dst;
+}
+
+#ifndef SYNC_PLAYER
+
+static unsigned char *put_varint(unsigned char *dst, uint32_t v)
+{
+	while (v >= 0x80) {
+		*dst++ = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	*dst++ = (unsigned char)v;
+	return dst;
+}
+
+static size_t varint_size(uint32_t v)
+{
+	size_t n = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+static int fixed_value(float v, int shift, int32_t *x)
+{
+	double s = v * (double)(1 << shift);
+	float back;
+	if (!(s > -FIXED_LIMIT && s < FIXED_LIMIT) || s != (int32_t)s)
+		return 0;
+	*x = (int32_t)s;
+	back = (float)(*x * (1.0 / (1 << shift)));
+	return !memcmp(&back, &v, sizeof(float)); /* catches -0.0 */
+}
+
+/* smallest lossless fixed-point shift, or -1 */
+static int fixed_shift(const struct sync_track *t)
+{
+	int i, shift;
+	int32_t x;
+	for (shift = 0; shift <= FIXED_MAX_SHIFT; ++shift) {
+		for (i = 0; i < t->num_keys; ++i)
+			if (!fixed_value(t->values[i], shift, &x))
+				break;
+		if (i == t->num_keys)
+			return shift;
+	}
+	return -1;
+}
+
+static size_t fixed_size(const struct sync_track *t, int shift)
+{
+	size_t size = 2;
+	int32_t x, prev = 0;
+	int i;
+	for (i = 0; i < t->num_keys; ++i) {
+		fixed_value(t->values[i], shift, &x);
+		size += varint_size(zigzag(x - prev));
+		prev = x;
+	}
+	return size;
+}
+
+static int palette_find(const float *palette, int count, float v)
+{
+	int i;
+	for (i = 0; i < count; ++i)
+		if (!memcmp(palette + i, &v, sizeof(float)))
+			return i;
+	return -1;
+}
+
+/* number of distinct values, or -1 if there are too many */
+static int build_palette(const struct sync_track *t, float *palette)
+{
+	int i, count = 0;
+	for (i = 0; i < t->num_keys; ++i) {
+		if (palette_find(palette, count, t->values[i]) >= 0)
+			continue;
+		if (count == PALETTE_MAX)
+			return -1;
+		palette[count++] = t->values[i];
+	}
+	return count;
+}
+
+size_t sync_compact_bound(int num_keys)
+{
+	/* fixed-point values take at most five bytes, like the rows */
+	return 5 + 5 * (size_t)num_keys + ((size_t)num_keys + 3) / 4 +
+	    2 + 5 * (size_t)num_keys;
+}
+
+size_t sync_compact_keys(const struct sync_track *t, unsigned char *dst)
+{
+	unsigned char *out = dst;
+	float palette[PALETTE_MAX];
+	size_t raw_size, best, size;
+	int i, shift, count, mode = VALUES_RAW;
+	int32_t x, prev = 0;
+
+	out = put_varint(out, t->num_keys);
+	if (!t->num_keys)
+		return out - dst;
+
+	out = put_varint(out, zigzag(t->rows[0]));
+	for (i = 1; i < t->num_keys; ++i)
+		out = put_varint(out, (uint32_t)t->rows[i] -
+		    (uint32_t)t->rows[i - 1] - 1);
+
+	memset(out, 0, (t->num_keys + 3) / 4);
+	for (i = 0; i < t->num_keys; ++i)
+		out[i >> 2] |= (t->types[i] & 3) << ((i & 3) * 2);
+	out += (t->num_keys + 3) / 4;
+
+	/* pick the smallest lossless value encoding */
+	best = raw_size = sizeof(float) * t->num_keys;
+	shift = fixed_shift(t);
+	if (shift >= 0 && (size = fixed_size(t, shift)) < best) {
+		best = size;
+		mode = VALUES_FIXED;
+	}
+	count = build_palette(t, palette);
+	if (count > 0 && 1 + sizeof(float) * count + t->num_keys < best)
+		mode = VALUES_PALETTE;
+
+	*out++ = (unsigned char)mode;
+	switch (mode) {
+	case VALUES_RAW:
+		memcpy(out, t->values, raw_size);
+		out += raw_size;
+		break;
+
+	case VALUES_FIXED:
+		*out++ = (unsigned char)shift;
+		for (i = 0; i < t->num_keys; ++i) {
+			fixed_value(t->values[i], shift, &x);
+			out = put_varint(out, zigzag(x - prev));
+			prev = x;
+		}
+		break;
+
+	case VALUES_PALETTE:
+		*out++ = (unsigned char)(count - 1);
+		memcpy(out, palette, sizeof(float) * count);
+		out += sizeof(float) * count;
+		for (i = 0; i < t->num_keys; ++i)
+			*out++ = (unsigned char)palette_find(palette, count,
+			    t->values[i]);
+		break;
+	}
+
+	assert((size_t)(out - dst) <= sync_compact_bound(t->num_keys));
+	return out - dst;
+}
+
+size_t sync_lz_bound(size_t size)
+{
+	return size + size / 255 + 16;
+}
+
+static unsigned char *lz_put_length(unsigned char *dst, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*dst++ = 255;
+	*dst++ = (unsigned char)len;
+	return dst;
+}
+
+/* a match length of zero ends the stream */
+static unsigned char *lz_put_sequence(unsigned char *dst,
+    const unsigned char *lit, size_t num_lit, size_t offset,
+    size_t match_len)
+{
+	size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+	*dst++ = (unsigned char)((num_lit < 15 ? num_lit : 15) << 4 |
+	    (ml < 15 ? ml : 15));
+	if (num_lit >= 15)
+		dst = lz_put_length(dst, num_lit - 15);
+	memcpy(dst, lit, num_lit);
+	dst += num_lit;
+
+	if (match_len) {
+		*dst++ = (unsigned char)(offset & 0xff);
+		*dst++ = (unsigned char)(offset >> 8);
+		if (ml >= 15)
+			dst = lz_put_length(dst, ml - 15);
+	}
+	return dst;
+}
+
+size_t sync_lz_compress(const unsigned char *src, size_t size,
+    unsigned char *dst)
+{
+	const unsigned char *ip = src, *anchor = src, *end = src + size;
+	unsigned char *op = dst;
+	size_t table[1 << LZ_HASH_BITS]; /* position + 1, zero if empty */
+
+	memset(table, 0, sizeof(table));
+	while (ip + LZ_MIN_MATCH <= end) {
+		uint32_t seq, h;
+		size_t cand, pos = ip - src;
+
+		memcpy(&seq, ip, sizeof(seq));
+		h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+		cand = table[h];
+		table[h] = pos + 1;
+
+		if (cand && pos + 1 - cand <= LZ_MAX_OFFSET &&
+		    !memcmp(src + cand - 1, ip, LZ_MIN_MATCH)) {
+			const unsigned char *match = src + cand - 1;
+			size_t len = LZ_MIN_MATCH;
+			while (ip + len < end && match[len] == ip[len])
+				len++;
+			op = lz_put_sequence(op, anchor, ip - anchor,
+			    ip - match, len);
+			ip += len;
+			anchor = ip;
+		} else
+			ip++;
+	}
+
+	op = lz_put_sequence(op, anchor, end - anchor, 0, 0);
+	assert((size_t)(op - dst) <= sync_lz_bound(size));
+	return op - dst;
+}
+
+#endif /* !defined(SYNC_PLAYER) */
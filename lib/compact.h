@@ -0,0 +1,24 @@
+#ifndef SYNC_COMPACT_H
+#define SYNC_COMPACT_H
+
+#include "base.h"
+#include "track.h"
+
+/*
+ * Compact key encoding for size-constrained exports: row deltas as
+ * varints, 2-bit key types, and values stored as fixed-point deltas or
+ * palette indices whenever that is lossless. sync_lz_* is an optional
+ * byte-oriented LZ77 stage on top of that.
+ */
+int sync_expand_keys(struct sync_track *, const unsigned char *, size_t);
+size_t sync_lz_decompress(const unsigned char *, size_t,
+    unsigned char *, size_t);
+
+#ifndef SYNC_PLAYER
+size_t sync_compact_bound(int);
+size_t sync_compact_keys(const struct sync_track *, unsigned char *);
+size_t sync_lz_bound(size_t);
+size_t sync_lz_compress(const unsigned char *, size_t, unsigned char *);
+#endif /* !defined(SYNC_PLAYER) */
+
+#endif /* SYNC_COMPACT_H */
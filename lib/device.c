@@ -1,20 +1,198 @@
 #include "device.h"
 #include "track.h"
+#include "compact.h"
 #include <assert.h>
 #include <ctype.h>
+#include <limits.h>
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
 
+unsigned int sync_hash_name(const char *name)
+{
+	uint32_t hash = 2166136261u;
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Everything that lives as long as the device is carved out of its arena:
+ * the device itself, the track structs and names, the lookup tables, and
+ * in the player, which never edits them, the keys. Nothing in it is freed
+ * before sync_destroy_device.
+ */
+#define ARENA_BLOCK_SIZE 4096
+
+static int arena_grow(struct sync_device *d, size_t size)
+{
+	struct arena_block *b;
+
+	/* double the block size, to need few blocks for many tracks */
+	if (size < d->arena->size * 2)
+		size = d->arena->size * 2;
+	if (size < ARENA_BLOCK_SIZE)
+		size = ARENA_BLOCK_SIZE;
+
+	b = sync_malloc(d->alloc, sizeof(*b) + size);
+	if (!b)
+		return -1;
+	b->next = d->arena;
+	b->size = size;
+	b->used = 0;
+	d->arena = b;
+	return 0;
+}
+
+static size_t arena_offset(const struct arena_block *b, size_t align)
+{
+	size_t data = (size_t)(b + 1);
+	return ((data + b->used + align - 1) & ~(align - 1)) - data;
+}
+
+static void *arena_alloc(struct sync_device *d, size_t size, size_t align)
+{
+	struct arena_block *b = d->arena;
+	size_t pos = arena_offset(b, align);
+
+	if (pos + size > b->size) {
+		if (arena_grow(d, size + align - 1))
+			return NULL;
+		b = d->arena;
+		pos = arena_offset(b, align);
+	}
+	b->used = pos + size;
+	return (char *)(b + 1) + pos;
+}
+
+/* make the next allocations up to size bytes come from a single block */
+static int arena_reserve(struct sync_device *d, size_t size)
+{
+	if (d->arena->size - d->arena->used >= size)
+		return 0;
+	return arena_grow(d, size);
+}
+
+static void arena_free(const struct sync_alloc_cb *alloc,
+    struct arena_block *b)
+{
+	while (b) {
+		struct arena_block *next = b->next;
+		sync_free(alloc, b);
+		b = next;
+	}
+}
+
+/* keys of a loaded track, kept in the arena by the player */
+static int alloc_track_keys(struct sync_device *d, struct sync_track *t,
+    int num_keys)
+{
+#ifdef SYNC_PLAYER
+	size_t offsets[4];
+	void *mem = arena_alloc(d, sync_key_layout(num_keys, offsets),
+	    KEY_ALIGN);
+	if (!mem)
+		return -1;
+	sync_place_keys(t, mem, num_keys);
+	return 0;
+#else
+	(void)d;
+	return sync_alloc_keys(t, num_keys);
+#endif
+}
+
+static int *alloc_track_index(struct sync_device *d, int num_buckets)
+{
+#ifdef SYNC_PLAYER
+	return arena_alloc(d, sizeof(int) * num_buckets, sizeof(int));
+#else
+	return sync_malloc(d->alloc, sizeof(int) * num_buckets);
+#endif
+}
+
+static int build_track_index(struct sync_device *d, struct sync_track *t)
+{
+	int shift, num_buckets = sync_index_size(t, &shift);
+	int *buckets;
+
+	if (!num_buckets)
+		return 0;
+	buckets = alloc_track_index(d, num_buckets);
+	if (!buckets)
+		return -1;
+	sync_place_index(t, buckets, num_buckets, shift);
+	return 0;
+}
+
 static int find_track(struct sync_device *d, const char *name)
 {
-	int i;
-	for (i = 0; i < (int)d->num_tracks; ++i)
-		if (!strcmp(name, d->tracks[i]->name))
-			return i;
+	size_t i, mask = d->num_slots - 1;
+	uint32_t hash = sync_hash_name(name);
+	if (!d->num_slots)
+		return -1;
+
+	for (i = hash & mask; d->track_slots[i] >= 0; i = (i + 1) & mask) {
+		const struct sync_track *t = d->tracks[d->track_slots[i]];
+		if (t->hash == hash && !strcmp(name, t->name))
+			return d->track_slots[i];
+	}
 	return -1; /* not found */
 }
 
+static void place_track_slot(struct sync_device *d, int idx)
+{
+	size_t i, mask = d->num_slots - 1;
+	for (i = d->tracks[idx]->hash & mask; d->track_slots[i] >= 0;
+	    i = (i + 1) & mask)
+		;
+	d->track_slots[i] = idx;
+}
+
+/* keep the load factor at or below one half */
+static size_t track_slots_for(size_t num_tracks)
+{
+	size_t num_slots;
+	for (num_slots = 64; num_slots < num_tracks * 2; num_slots *= 2)
+		;
+	return num_slots;
+}
+
+static int reserve_tracks(struct sync_device *d, size_t max_tracks)
+{
+	struct sync_track **tracks;
+	size_t i, num_slots = track_slots_for(max_tracks);
+	int *slots, *hints;
+
+	if (max_tracks <= d->max_tracks)
+		return 0;
+
+	tracks = arena_alloc(d, sizeof(*tracks) * max_tracks,
+	    sizeof(*tracks));
+	hints = arena_alloc(d, sizeof(int) * max_tracks, sizeof(int));
+	slots = arena_alloc(d, sizeof(int) * num_slots, sizeof(int));
+	if (!tracks || !hints || !slots)
+		return -1;
+
+	if (d->num_tracks) {
+		memcpy(tracks, d->tracks, sizeof(*tracks) * d->num_tracks);
+		memcpy(hints, d->hints, sizeof(int) * d->num_tracks);
+	}
+	d->tracks = tracks;
+	d->hints = hints;
+	d->max_tracks = max_tracks;
+	d->track_slots = slots;
+	d->num_slots = num_slots;
+	for (i = 0; i < num_slots; ++i)
+		slots[i] = -1;
+
+	/* rehash from the stored hashes, without touching the names */
+	for (i = 0; i < d->num_tracks; ++i)
+		place_track_slot(d, (int)i);
+	return 0;
+}
+
 static const char *path_encode(const char *path)
 {
 	static char temp[FILENAME_MAX];
@@ -52,9 +230,75 @@ static const char *sync_track_path(const char *base, const char *name)
 	return temp;
 }
 
+static const char *sync_pack_path(const char *base)
+{
+	static char temp[FILENAME_MAX];
+	strncpy(temp, base, sizeof(temp) - 1);
+	temp[sizeof(temp) - 1] = '\0';
+	strncat(temp, ".pack", sizeof(temp) - strlen(temp) - 1);
+	return temp;
+}
+
+/*
+ * A packed export holds every track in one file: a header, a directory
+ * hashed by track name, the names, and one blob per track. Each blob
+ * holds the rows, values and types as laid out in memory (see
+ * sync_key_layout), followed by the jump table, if any. The segment
+ * polynomials are rebuilt on load. Blobs start at PACK_ALIGN byte
+ * offsets. Like the .track files, everything is stored in native byte
+ * order.
+ *
+ * With PACK_COMPACT, the blobs are instead back to back in the encoding
+ * of sync_compact_keys, possibly LZ compressed, and have no jump table.
+ * Such exports are decoded on load rather than used in place.
+ */
+#define PACK_MAGIC "RKTP"
+#define PACK_VERSION 4
+#define PACK_ALIGN KEY_ALIGN
+#define PACK_COMPACT 1
+#define PACK_MAX_EXPANSION 256 /* of the LZ stage, which is about 255 */
+
+enum {
+	PACK_UNKNOWN = -1,
+	PACK_ABSENT = 0,
+	PACK_LOADED = 1
+};
+
+struct pack_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t flags;
+	uint32_t num_tracks;
+	uint32_t num_slots; /* power of two */
+	uint32_t names_size;
+};
+
+struct pack_entry {
+	uint32_t hash;
+	uint32_t name_offset;
+	uint32_t num_keys;
+	uint32_t keys_offset; /* zero for empty slots */
+	uint32_t keys_size;
+	uint32_t raw_size; /* keys_size unless LZ compressed */
+};
+
+static inline uint32_t pack_align(uint32_t offset)
+{
+	return (offset + PACK_ALIGN - 1) & ~(uint32_t)(PACK_ALIGN - 1);
+}
+
+/* the key layout up to the polynomials */
+static size_t pack_keys_size(int num_keys)
+{
+	size_t offsets[4];
+	sync_key_layout(num_keys, offsets);
+	return offsets[3];
+}
+
 #ifndef SYNC_PLAYER
 
 #define CLIENT_GREET "hello, synctracker!"
+#define CLIENT_GREET_HASHES "hello, synctracker?" /* GET_TRACK_HASH */
 #define SERVER_GREET "hello, demo!"
 
 enum {
@@ -63,12 +307,58 @@ enum {
 	GET_TRACK = 2,
 	SET_ROW = 3,
 	PAUSE = 4,
-	SAVE_TRACKS = 5
+	SAVE_TRACKS = 5,
+	GET_TRACK_HASH = 6, /* GET_TRACK, unless our keys match the hash */
+	CLEAR_TRACK = 7 /* the keys didn't match, new ones follow */
 };
 
-static inline int socket_poll(SOCKET socket)
+/* bytes of a command, including the command byte, or 0 if unknown */
+static size_t command_size(unsigned char cmd)
+{
+	switch (cmd) {
+	case SET_KEY: return 1 + 4 + 4 + 4 + 1;
+	case DELETE_KEY: return 1 + 4 + 4;
+	case SET_ROW: return 1 + 4;
+	case PAUSE: return 1 + 1;
+	case SAVE_TRACKS: return 1;
+	case CLEAR_TRACK: return 1 + 4;
+	}
+	return 0;
+}
+
+#define MAX_COMMAND_SIZE 14
+#define RECV_BUFFER_SIZE 16384 /* power of two */
+#define SEND_BUFFER_SIZE 4096
+
+static int socket_set_nonblocking(SOCKET s)
+{
+#ifdef WIN32
+	u_long on = 1;
+	return ioctlsocket(s, FIONBIO, &on) ? -1 : 0;
+#elif defined(USE_AMITCP)
+	long on = 1;
+	return IoctlSocket(s, FIONBIO, (char *)&on) ? -1 : 0;
+#else
+	int flags = fcntl(s, F_GETFL, 0);
+	if (flags < 0)
+		return -1;
+	return fcntl(s, F_SETFL, flags | O_NONBLOCK) ? -1 : 0;
+#endif
+}
+
+static inline int socket_would_block(void)
+{
+#ifdef WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#elif defined(USE_AMITCP)
+	return Errno() == EWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+#endif
+}
+
+static inline void socket_wait_send(SOCKET socket)
 {
-	struct timeval to = { 0, 0 };
 	fd_set fds;
 
 	FD_ZERO(&fds);
@@ -82,17 +372,30 @@ static inline int socket_poll(SOCKET socket)
 #pragma warning(pop)
 #endif
 
-	return select((int)socket + 1, &fds, NULL, NULL, &to) > 0;
+	select((int)socket + 1, NULL, &fds, NULL, NULL);
 }
 
-static inline int xsend(SOCKET s, const void *buf, size_t len, int flags)
+/* send all of buf, waiting out a full send buffer */
+static int xsend(SOCKET s, const void *buf, size_t len, int flags)
 {
+	const char *p = (const char *)buf;
+
+	while (len) {
 #ifdef WIN32
-	assert(len <= INT_MAX);
-	return send(s, (const char *)buf, (int)len, flags) != (int)len;
+		int n = send(s, p, len < INT_MAX ? (int)len : INT_MAX, flags);
 #else
-	return send(s, (const char *)buf, len, flags) != (int)len;
+		int n = (int)send(s, p, len, flags);
 #endif
+		if (n < 0) {
+			if (!socket_would_block())
+				return -1;
+			socket_wait_send(s);
+			continue;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
 }
 
 static inline int xrecv(SOCKET s, void *buf, size_t len, int flags)
@@ -109,32 +412,41 @@ static inline int xrecv(SOCKET s, void *buf, size_t len, int flags)
 static struct Library *socket_base = NULL;
 #endif
 
-static SOCKET server_connect(const char *host, unsigned short nport)
+/* once per process, before the first socket of any kind of connect */
+static int socket_init(void)
 {
-	SOCKET sock = INVALID_SOCKET;
-#ifdef USE_GETADDRINFO
-	struct addrinfo *addr, *curr;
-	char port[6];
-#else
-	struct hostent *he;
-	char **ap;
-#endif
-
 #ifdef WIN32
 	static int need_init = 1;
 	if (need_init) {
 		WSADATA wsa;
 		if (WSAStartup(MAKEWORD(2, 0), &wsa))
-			return INVALID_SOCKET;
+			return -1;
 		need_init = 0;
 	}
 #elif defined(USE_AMITCP)
 	if (!socket_base) {
 		socket_base = OpenLibrary("bsdsocket.library", 4);
 		if (!socket_base)
-			return INVALID_SOCKET;
+			return -1;
 	}
 #endif
+	return 0;
+}
+
+static SOCKET server_connect(const char *host, unsigned short nport,
+    const char *client_greet)
+{
+	SOCKET sock = INVALID_SOCKET;
+#ifdef USE_GETADDRINFO
+	struct addrinfo *addr, *curr;
+	char port[6];
+#else
+	struct hostent *he;
+	char **ap;
+#endif
+
+	if (socket_init())
+		return INVALID_SOCKET;
 
 #ifdef USE_GETADDRINFO
 
@@ -172,8 +484,13 @@ static SOCKET server_connect(const char *host, unsigned short nport)
 
 		if (connect(sock, sa, sa_len) >= 0) {
 			char greet[128];
+			int nodelay = 1;
+
+			/* requests are batched by hand, don't hold them back */
+			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY,
+			    (const char *)&nodelay, sizeof(nodelay));
 
-			if (xsend(sock, CLIENT_GREET, strlen(CLIENT_GREET), 0) ||
+			if (xsend(sock, client_greet, strlen(client_greet), 0) ||
 			    xrecv(sock, greet, strlen(SERVER_GREET), 0)) {
 				closesocket(sock);
 				sock = INVALID_SOCKET;
@@ -195,315 +512,2095 @@ static SOCKET server_connect(const char *host, unsigned short nport)
 	return sock;
 }
 
-#else
-
-void sync_set_io_cb(struct sync_device *d, struct sync_io_cb *cb)
+static uint32_t read_u32(const unsigned char *p)
 {
-	d->io_cb.open = cb->open;
-	d->io_cb.read = cb->read;
-	d->io_cb.close = cb->close;
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return ntohl(v);
 }
 
-#endif
-
-#ifdef NEED_STRDUP
-static inline char *rocket_strdup(const char *str)
+/*
+ * Read what the socket has into the receive ring without blocking.
+ * Returns 1 if the ring filled up before the socket ran dry, and -1 if
+ * the connection is gone.
+ */
+static int recv_pending(struct sync_device *d)
 {
-	char *ret = malloc(strlen(str) + 1);
-	if (ret)
-		strcpy(ret, str);
-	return ret;
+	while (d->recv_len < RECV_BUFFER_SIZE) {
+		size_t end = (d->recv_pos + d->recv_len) & (RECV_BUFFER_SIZE - 1);
+		size_t space = end < d->recv_pos ? d->recv_pos - end :
+		    RECV_BUFFER_SIZE - end;
+		int n = (int)recv(d->sock, (char *)d->recv_buf + end,
+		    (int)space, 0);
+		if (n < 0)
+			return socket_would_block() ? 0 : -1;
+		if (!n)
+			return -1;
+		d->recv_len += n;
+	}
+	return 1;
 }
-#define strdup rocket_strdup
-#endif
 
-struct sync_device *sync_create_device(const char *base)
+/* copy the next len bytes out of the receive ring */
+static void recv_take(struct sync_device *d, unsigned char *dst, size_t len)
 {
-	struct sync_device *d = malloc(sizeof(*d));
-	if (!d)
-		return NULL;
+	size_t first = RECV_BUFFER_SIZE - d->recv_pos;
+	if (first > len)
+		first = len;
+	memcpy(dst, d->recv_buf + d->recv_pos, first);
+	memcpy(dst + first, d->recv_buf, len - first);
+	d->recv_pos = (d->recv_pos + len) & (RECV_BUFFER_SIZE - 1);
+	d->recv_len -= len;
+}
 
-	d->base = strdup(path_encode(base));
-	if (!d->base) {
-		free(d);
-		return NULL;
+/*
+ * Decode the next command in the receive ring. Returns 0 if only part
+ * of one has arrived yet, and -1 for an unknown command.
+ */
+static int recv_command(struct sync_device *d, struct sync_cmd *c)
+{
+	unsigned char msg[MAX_COMMAND_SIZE];
+	union {
+		float f;
+		uint32_t i;
+	} v;
+	size_t size;
+
+	if (!d->recv_len)
+		return 0;
+	c->cmd = d->recv_buf[d->recv_pos];
+	size = command_size(c->cmd);
+	if (!size) {
+		fprintf(stderr, "unknown cmd: %02x\n", c->cmd);
+		return -1;
+	}
+	if (d->recv_len < size)
+		return 0;
+	recv_take(d, msg, size);
+
+	switch (c->cmd) {
+	case SET_KEY:
+		c->track = read_u32(msg + 1);
+		c->row = read_u32(msg + 5);
+		v.i = read_u32(msg + 9);
+		c->value = v.f;
+		c->type = msg[13];
+		break;
+	case DELETE_KEY:
+		c->track = read_u32(msg + 1);
+		c->row = read_u32(msg + 5);
+		break;
+	case SET_ROW:
+		c->row = read_u32(msg + 1);
+		break;
+	case PAUSE:
+		c->type = msg[1];
+		break;
+	case CLEAR_TRACK:
+		c->track = read_u32(msg + 1);
+		break;
 	}
+	return 1;
+}
 
-	d->tracks = NULL;
-	d->num_tracks = 0;
+#ifdef USE_NET_THREAD
 
-#ifndef SYNC_PLAYER
-	d->row = -1;
-	d->sock = INVALID_SOCKET;
-#endif
+/*
+ * Threaded mode: a thread reads the socket and decodes commands into a
+ * single-producer, single-consumer ring that sync_update drains. Each
+ * side only writes its own index, after the entries it covers.
+ */
+#define NET_QUEUE_SIZE 4096 /* commands, power of two */
+#define NET_CLOSED 0xff /* queued by the thread when the socket dies */
 
-	d->io_cb.open = (void *(*)(const char *, const char *))fopen;
-	d->io_cb.read = (size_t (*)(void *, size_t, size_t, void *))fread;
-	d->io_cb.close = (int (*)(void *))fclose;
+static int net_queue_full(struct sync_device *d)
+{
+	return d->net_tail - load_acquire(&d->net_head) == NET_QUEUE_SIZE;
+}
 
-	return d;
+static int net_push(struct sync_device *d, const struct sync_cmd *c)
+{
+	size_t tail = d->net_tail;
+	if (net_queue_full(d))
+		return -1;
+	d->net_queue[tail & (NET_QUEUE_SIZE - 1)] = *c;
+	store_release(&d->net_tail, tail + 1);
+	return 0;
 }
 
-void sync_destroy_device(struct sync_device *d)
+static int net_pop(struct sync_device *d, struct sync_cmd *c)
 {
-	int i;
+	size_t head = d->net_head;
+	if (head == load_acquire(&d->net_tail))
+		return 0;
+	*c = d->net_queue[head & (NET_QUEUE_SIZE - 1)];
+	store_release(&d->net_head, head + 1);
+	return 1;
+}
 
-#ifndef SYNC_PLAYER
-	if (d->sock != INVALID_SOCKET)
-		closesocket(d->sock);
+static void net_sleep(void)
+{
+#ifdef _WIN32
+	Sleep(1);
+#else
+	struct timeval to = { 0, 1000 };
+	select(0, NULL, NULL, NULL, &to);
 #endif
+}
 
-	for (i = 0; i < (int)d->num_tracks; ++i) {
-		free(d->tracks[i]->name);
-		free(d->tracks[i]->keys);
-		free(d->tracks[i]);
-	}
-	free(d->tracks);
-	free(d->base);
-	free(d);
+/* wait up to 100ms for something to read */
+static int socket_wait_recv(SOCKET socket)
+{
+	struct timeval to = { 0, 100000 };
+	fd_set fds;
 
-#if defined(USE_AMITCP) && !defined(SYNC_PLAYER)
-	if (socket_base) {
-		CloseLibrary(socket_base);
-		socket_base = NULL;
-	}
+	FD_ZERO(&fds);
+
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable: 4127)
+#endif
+	FD_SET(socket, &fds);
+#ifdef _MSC_VER
+#pragma warning(pop)
 #endif
+
+	return select((int)socket + 1, &fds, NULL, NULL, &to) > 0;
 }
 
-static int read_track_data(struct sync_device *d, struct sync_track *t)
+static void net_loop(struct sync_device *d)
 {
-	int i;
-	void *fp = d->io_cb.open(sync_track_path(d->base, t->name), "rb");
-	if (!fp)
-		return -1;
+	struct sync_cmd c;
+	int ret = 0;
 
-	d->io_cb.read(&t->num_keys, sizeof(int), 1, fp);
-	t->keys = malloc(sizeof(struct track_key) * t->num_keys);
-	if (!t->keys)
-		return -1;
+	while (!load_acquire(&d->net_stop) && ret >= 0) {
+		if (net_queue_full(d)) {
+			/* let the demo catch up */
+			net_sleep();
+			continue;
+		}
+		ret = recv_command(d, &c);
+		if (ret > 0)
+			net_push(d, &c);
+		else if (!ret && socket_wait_recv(d->sock))
+			ret = recv_pending(d);
+	}
 
-	for (i = 0; i < (int)t->num_keys; ++i) {
-		struct track_key *key = t->keys + i;
-		char type;
-		d->io_cb.read(&key->row, sizeof(int), 1, fp);
-		d->io_cb.read(&key->value, sizeof(float), 1, fp);
-		d->io_cb.read(&type, sizeof(char), 1, fp);
-		key->type = (enum key_type)type;
+	if (ret < 0) {
+		c.cmd = NET_CLOSED;
+		while (net_push(d, &c) && !load_acquire(&d->net_stop))
+			net_sleep();
 	}
+}
 
-	d->io_cb.close(fp);
+#ifdef _WIN32
+static DWORD WINAPI net_thread(LPVOID param)
+{
+	net_loop((struct sync_device *)param);
 	return 0;
 }
+#else
+static void *net_thread(void *param)
+{
+	net_loop((struct sync_device *)param);
+	return NULL;
+}
+#endif
 
-static int save_track(const struct sync_track *t, const char *path)
+static int start_net_thread(struct sync_device *d)
 {
-	int i;
-	FILE *fp = fopen(path, "wb");
-	if (!fp)
+	if (!d->net_queue)
+		d->net_queue = arena_alloc(d,
+		    sizeof(struct sync_cmd) * NET_QUEUE_SIZE,
+		    sizeof(uint32_t));
+	if (!d->net_queue)
 		return -1;
+	d->net_head = d->net_tail = 0;
+	d->net_stop = 0;
 
-	fwrite(&t->num_keys, sizeof(int), 1, fp);
-	for (i = 0; i < (int)t->num_keys; ++i) {
-		char type = (char)t->keys[i].type;
-		fwrite(&t->keys[i].row, sizeof(int), 1, fp);
-		fwrite(&t->keys[i].value, sizeof(float), 1, fp);
-		fwrite(&type, sizeof(char), 1, fp);
-	}
-
-	fclose(fp);
+#ifdef _WIN32
+	d->net_thread = CreateThread(NULL, 0, net_thread, d, 0, NULL);
+	if (!d->net_thread)
+		return -1;
+#else
+	if (pthread_create(&d->net_thread, NULL, net_thread, d))
+		return -1;
+#endif
+	d->net_running = 1;
 	return 0;
 }
 
-void sync_save_tracks(const struct sync_device *d)
+static void stop_net_thread(struct sync_device *d)
 {
-	int i;
-	for (i = 0; i < (int)d->num_tracks; ++i) {
-		const struct sync_track *t = d->tracks[i];
-		save_track(t, sync_track_path(d->base, t->name));
-	}
+	if (!d->net_running)
+		return;
+
+	/* wakes the thread up if it is waiting for data */
+	store_release(&d->net_stop, 1);
+#ifdef _WIN32
+	shutdown(d->sock, SD_RECEIVE);
+	WaitForSingleObject(d->net_thread, INFINITE);
+	CloseHandle(d->net_thread);
+#else
+	shutdown(d->sock, SHUT_RD);
+	pthread_join(d->net_thread, NULL);
+#endif
+	d->net_running = 0;
 }
 
-#ifndef SYNC_PLAYER
+#endif /* defined(USE_NET_THREAD) */
 
-static int fetch_track_data(struct sync_device *d, struct sync_track *t)
+static void close_connection(struct sync_device *d)
 {
-	unsigned char cmd = GET_TRACK;
-	uint32_t name_len;
+#ifdef USE_NET_THREAD
+	stop_net_thread(d);
+#endif
+	closesocket(d->sock);
+	d->sock = INVALID_SOCKET;
+}
 
-	assert(strlen(t->name) <= UINT32_MAX);
-	name_len = htonl((uint32_t)strlen(t->name));
+enum {
+	CONN_NONE, /* connected, or not connecting by ourselves */
+	CONN_WAIT, /* waiting for the next attempt */
+	CONN_CONNECTING,
+	CONN_GREETING
+};
 
-	/* send request data */
-	if (xsend(d->sock, (char *)&cmd, 1, 0) ||
-	    xsend(d->sock, (char *)&name_len, sizeof(name_len), 0) ||
-	    xsend(d->sock, t->name, (int)strlen(t->name), 0))
-	{
-		closesocket(d->sock);
-		d->sock = INVALID_SOCKET;
+static void cancel_connect(struct sync_device *d)
+{
+	if (d->conn_sock != INVALID_SOCKET)
+		closesocket(d->conn_sock);
+	d->conn_sock = INVALID_SOCKET;
+	d->conn_state = CONN_NONE;
+	sync_free(d->alloc, d->conn_host);
+	d->conn_host = NULL;
+#ifdef USE_GETADDRINFO
+	if (d->conn_addrs)
+		freeaddrinfo(d->conn_addrs);
+	d->conn_addrs = d->conn_next = d->conn_curr = NULL;
+#else
+	d->conn_resolved = 0;
+#endif
+}
+
+int sync_set_threaded(struct sync_device *d, int threaded)
+{
+#ifdef USE_NET_THREAD
+	d->threaded = threaded;
+	return 0;
+#else
+	return threaded ? -1 : 0;
+#endif
+}
+
+#else
+
+void sync_set_io_cb(struct sync_device *d, struct sync_io_cb *cb)
+{
+	d->io_cb.open = cb->open;
+	d->io_cb.read = cb->read;
+	d->io_cb.close = cb->close;
+	d->io_cb.map = cb->map;
+	d->io_cb.unmap = cb->unmap;
+	d->io_cb.size = cb->size;
+	d->io_cb.seek = cb->seek;
+}
+
+#endif
+
+static long file_size(void *stream)
+{
+	FILE *fp = stream;
+	long pos = ftell(fp), size;
+	if (pos < 0 || fseek(fp, 0, SEEK_END))
+		return -1;
+	size = ftell(fp);
+	if (fseek(fp, pos, SEEK_SET))
+		return -1;
+	return size;
+}
+
+#ifdef USE_MMAP
+
+static const void *file_map(const char *filename, size_t *size)
+{
+	struct stat st;
+	void *data;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || !st.st_size) {
+		close(fd);
+		return NULL;
+	}
+
+	data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	*size = (size_t)st.st_size;
+	return data;
+}
+
+static void file_unmap(const void *data, size_t size)
+{
+	munmap((void *)data, size);
+}
+
+#elif defined(USE_WIN32_MAP)
+
+static const void *file_map(const char *filename, size_t *size)
+{
+	HANDLE file, mapping;
+	const void *data = NULL;
+	DWORD high, low;
+
+	file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+	    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	low = GetFileSize(file, &high);
+	if (low == INVALID_FILE_SIZE || high || !low) {
+		CloseHandle(file);
+		return NULL;
+	}
+
+	mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping) {
+		data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(mapping);
+	}
+	CloseHandle(file);
+
+	*size = low;
+	return data;
+}
+
+static void file_unmap(const void *data, size_t size)
+{
+	UnmapViewOfFile(data);
+}
+
+#endif
+
+struct sync_device *sync_create_device(const char *base)
+{
+	return sync_create_device_alloc(base, NULL);
+}
+
+struct sync_device *sync_create_device_alloc(const char *base,
+    const struct sync_alloc_cb *cb)
+{
+	struct sync_device *d;
+	struct arena_block *arena;
+	size_t size;
+
+	/* the device and its base path head the first arena block */
+	base = path_encode(base);
+	size = sizeof(*d) + strlen(base) + 1;
+	arena = sync_malloc(cb, sizeof(*arena) + size);
+	if (!arena)
+		return NULL;
+	arena->next = NULL;
+	arena->size = arena->used = size;
+
+	d = (struct sync_device *)(arena + 1);
+	d->arena = arena;
+	d->base = strcpy((char *)(d + 1), base);
+	if (cb)
+		d->alloc_cb = *cb;
+	else
+		memset(&d->alloc_cb, 0, sizeof(d->alloc_cb));
+	d->alloc = cb ? &d->alloc_cb : NULL;
+
+	d->tracks = NULL;
+	d->hints = NULL;
+	d->num_tracks = 0;
+	d->max_tracks = 0;
+	d->track_slots = NULL;
+	d->num_slots = 0;
+	d->pack_state = PACK_UNKNOWN;
+	d->pack_map = NULL;
+	d->pack_map_size = 0;
+
+#ifndef SYNC_PLAYER
+	d->save_flags = SYNC_SAVE_TRACKS;
+	d->row = -1;
+	d->sock = INVALID_SOCKET;
+	d->recv_buf = NULL;
+	d->recv_pos = d->recv_len = 0;
+	d->send_buf = NULL;
+	d->send_len = 0;
+	d->conn_host = NULL;
+	d->conn_state = CONN_NONE;
+	d->conn_sock = INVALID_SOCKET;
+#ifdef USE_GETADDRINFO
+	d->conn_addrs = d->conn_next = d->conn_curr = NULL;
+#else
+	d->conn_resolved = 0;
+#endif
+	d->hashes = 0;
+	d->snapshots = 0;
+	d->epoch = 0;
+	d->retired = NULL;
+	d->version = 0;
+	d->version_open = 0;
+	d->notified = 0;
+	d->changed = NULL;
+	d->num_changed = d->max_changed = 0;
+#ifdef USE_NET_THREAD
+	d->threaded = 0;
+	d->net_running = 0;
+	d->net_queue = NULL;
+#endif
+#endif
+
+	d->io_cb.open = (void *(*)(const char *, const char *))fopen;
+	d->io_cb.read = (size_t (*)(void *, size_t, size_t, void *))fread;
+	d->io_cb.close = (int (*)(void *))fclose;
+	d->io_cb.size = file_size;
+	d->io_cb.seek = (int (*)(void *, long, int))fseek;
+#if defined(USE_MMAP) || defined(USE_WIN32_MAP)
+	d->io_cb.map = file_map;
+	d->io_cb.unmap = file_unmap;
+#else
+	d->io_cb.map = NULL;
+	d->io_cb.unmap = NULL;
+#endif
+
+	return d;
+}
+
+#ifndef SYNC_PLAYER
+
+/*
+ * Snapshots: a published version owns the keys and index it points to,
+ * and the live track borrows them (mapped) until an edit copies them.
+ * Replaced versions wait in d->retired until sync_reclaim_snapshots.
+ */
+struct track_version {
+	struct sync_track keys; /* first, snapshots are cast back */
+	void *key_mem;
+	int *buckets;
+	unsigned long epoch; /* when it was replaced */
+	struct track_version *next;
+};
+
+static void free_version(const struct sync_device *d,
+    struct track_version *v)
+{
+	sync_free(d->alloc, v->key_mem);
+	sync_free(d->alloc, v->buckets);
+	sync_free(d->alloc, v->keys.bake);
+	sync_free(d->alloc, v);
+}
+
+/* freed once readers pass the current epoch */
+static void retire_version(struct sync_device *d, struct track_version *v)
+{
+	v->epoch = d->epoch;
+	v->next = d->retired;
+	d->retired = v;
+}
+
+/*
+ * Give the track a new version, in v unless that is NULL. 1 if it got
+ * one, 0 if it did not change since its last, and -1 if out of memory,
+ * in which case readers keep the old version.
+ */
+static int publish_track(struct sync_device *d, struct sync_track *t,
+    struct track_version *v)
+{
+	struct track_version *old = (struct track_version *)t->snapshot;
+
+	if (old && t->mapped && t->rows == old->keys.rows &&
+	    t->num_keys == old->keys.num_keys &&
+	    t->index.buckets == old->keys.index.buckets)
+		return 0;
+
+	if (!v && !(v = sync_malloc(d->alloc, sizeof(*v))))
+		return -1;
+
+	v->keys = *t;
+	v->keys.edits = NULL;
+	v->keys.num_edits = v->keys.max_edits = 0;
+	v->keys.editing = v->keys.clearing = 0;
+	v->keys.key_mem = NULL;
+	v->keys.max_keys = 0;
+	v->keys.mapped = 1;
+	v->keys.snapshot = NULL;
+	v->keys.bake = NULL; /* the live track's to drop */
+	v->key_mem = v->buckets = NULL;
+	if (!t->mapped) {
+		/* hand the keys over, and borrow them back */
+		v->key_mem = t->key_mem;
+		v->buckets = t->index.buckets;
+		t->key_mem = NULL;
+		t->max_keys = 0;
+		t->mapped = 1;
+	}
+	store_release(&t->snapshot, &v->keys);
+
+	if (old)
+		retire_version(d, old);
+	return 1;
+}
+
+static void publish_tracks(struct sync_device *d)
+{
+	int i, published = 0;
+
+	if (!d->snapshots)
+		return;
+	for (i = 0; i < (int)d->num_tracks; ++i)
+		if (publish_track(d, d->tracks[i], NULL) > 0)
+			published = 1;
+	if (published)
+		store_release(&d->epoch, d->epoch + 1);
+}
+
+/* a track without a version would leave readers with the live one */
+static int enable_snapshots(struct sync_device *d)
+{
+	struct track_version *spare = NULL, *v;
+	int i;
+
+	for (i = 0; i < (int)d->num_tracks; ++i) {
+		v = sync_malloc(d->alloc, sizeof(*v));
+		if (!v)
+			break;
+		v->next = spare;
+		spare = v;
+	}
+	if (i == (int)d->num_tracks) {
+		for (i = 0; i < (int)d->num_tracks; ++i) {
+			v = spare->next;
+			if (publish_track(d, d->tracks[i], spare) > 0)
+				spare = v;
+		}
+		d->snapshots = 1;
+	}
+	while (spare) {
+		v = spare->next;
+		sync_free(d->alloc, spare);
+		spare = v;
+	}
+	return d->snapshots ? 0 : -1;
+}
+
+static int disable_snapshots(struct sync_device *d)
+{
+	int i;
+
+	/* the live tracks stop borrowing the keys of their versions */
+	for (i = 0; i < (int)d->num_tracks; ++i) {
+		struct sync_track *t = d->tracks[i];
+		const struct track_version *v =
+		    (const struct track_version *)t->snapshot;
+		if (v && v->key_mem && t->rows == v->keys.rows &&
+		    sync_own_keys(t))
+			return -1;
+	}
+
+	for (i = 0; i < (int)d->num_tracks; ++i) {
+		struct sync_track *t = d->tracks[i];
+		struct track_version *v = (struct track_version *)t->snapshot;
+		if (v) {
+			store_release(&t->snapshot, NULL);
+			retire_version(d, v);
+		}
+	}
+	d->snapshots = 0;
+	store_release(&d->epoch, d->epoch + 1);
+	return 0;
+}
+
+int sync_set_snapshots(struct sync_device *d, int enable)
+{
+	if (!enable == !d->snapshots)
+		return 0;
+	return enable ? enable_snapshots(d) : disable_snapshots(d);
+}
+
+unsigned long sync_device_epoch(const struct sync_device *d)
+{
+	return load_acquire(&d->epoch);
+}
+
+unsigned long sync_device_version(const struct sync_device *d)
+{
+	return d->version;
+}
+
+void sync_reclaim_snapshots(struct sync_device *d, unsigned long epoch)
+{
+	struct track_version **p = &d->retired;
+
+	while (*p) {
+		struct track_version *v = *p;
+		if ((long)(epoch - v->epoch) > 0) {
+			*p = v->next;
+			free_version(d, v);
+		} else
+			p = &v->next;
+	}
+}
+
+const struct sync_track *sync_track_snapshot(const struct sync_track *t)
+{
+	const struct sync_track *snapshot = load_acquire(&t->snapshot);
+	return snapshot ? snapshot : t;
+}
+
+#else
+
+int sync_set_snapshots(struct sync_device *d, int enable)
+{
+	(void)d;
+	(void)enable;
+	return 0;
+}
+
+unsigned long sync_device_epoch(const struct sync_device *d)
+{
+	(void)d;
+	return 0;
+}
+
+unsigned long sync_device_version(const struct sync_device *d)
+{
+	(void)d;
+	return 0;
+}
+
+void sync_reclaim_snapshots(struct sync_device *d, unsigned long epoch)
+{
+	(void)d;
+	(void)epoch;
+}
+
+/* nothing edits the player's tracks */
+const struct sync_track *sync_track_snapshot(const struct sync_track *t)
+{
+	return t;
+}
+
+#endif /* !defined(SYNC_PLAYER) */
+
+void sync_destroy_device(struct sync_device *d)
+{
+	struct sync_alloc_cb alloc_cb = d->alloc_cb;
+	int i;
+
+#ifndef SYNC_PLAYER
+	cancel_connect(d);
+	if (d->sock != INVALID_SOCKET)
+		close_connection(d);
+#endif
+
+	for (i = 0; i < (int)d->num_tracks; ++i) {
+		sync_free_keys(d->tracks[i]);
+#ifndef SYNC_PLAYER
+		if (d->tracks[i]->snapshot)
+			free_version(d,
+			    (struct track_version *)d->tracks[i]->snapshot);
+#endif
+	}
+#ifndef SYNC_PLAYER
+	sync_reclaim_snapshots(d, d->epoch + 1);
+	sync_free(d->alloc, (void *)d->changed);
+#endif
+	if (d->pack_map && d->io_cb.unmap)
+		d->io_cb.unmap(d->pack_map, d->pack_map_size);
+	/* the callbacks live in the arena too */
+	arena_free(d->alloc ? &alloc_cb : NULL, d->arena);
+
+#if defined(USE_AMITCP) && !defined(SYNC_PLAYER)
+	if (socket_base) {
+		CloseLibrary(socket_base);
+		socket_base = NULL;
+	}
+#endif
+}
+
+/* size of a key in a .track file: row, value and type */
+#define TRACK_KEY_SIZE (sizeof(int) + sizeof(float) + 1)
+
+/* a missing file leaves the track empty, a damaged one is an error */
+static int read_track_data(struct sync_device *d, struct sync_track *t)
+{
+	int i, num_keys;
+	unsigned char *buf = NULL;
+	const unsigned char *src;
+	long size = -1;
+	void *fp = d->io_cb.open(sync_track_path(d->base, t->name), "rb");
+	if (!fp)
+		return 0;
+
+	if (d->io_cb.size)
+		size = d->io_cb.size(fp);
+
+	if (d->io_cb.read(&num_keys, sizeof(int), 1, fp) != 1 ||
+	    num_keys < 0 || (size_t)num_keys > (size_t)-1 / TRACK_KEY_SIZE - 1 ||
+	    (size >= 0 && (unsigned long)size !=
+	    sizeof(int) + TRACK_KEY_SIZE * (unsigned long)num_keys))
+		goto fail;
+
+	/* fetch all keys at once, and decode them from memory */
+	buf = sync_malloc(d->alloc, TRACK_KEY_SIZE * num_keys + 1);
+	if (!buf || d->io_cb.read(buf, TRACK_KEY_SIZE, num_keys, fp) !=
+	    (size_t)num_keys || alloc_track_keys(d, t, num_keys))
+		goto fail;
+
+	for (i = 0, src = buf; i < num_keys; ++i) {
+		memcpy(t->rows + i, src, sizeof(int));
+		memcpy(t->values + i, src + sizeof(int), sizeof(float));
+		t->types[i] = src[sizeof(int) + sizeof(float)];
+		src += TRACK_KEY_SIZE;
+	}
+	sync_update_polys(t, 0, t->num_keys);
+	build_track_index(d, t);
+
+	sync_free(d->alloc, buf);
+	d->io_cb.close(fp);
+	return 0;
+
+fail:
+	sync_free(d->alloc, buf);
+	d->io_cb.close(fp);
+	return -1;
+}
+
+#ifndef SYNC_PLAYER
+
+static int save_track(const struct sync_track *t, const char *path)
+{
+	int i;
+	FILE *fp = fopen(path, "wb");
+	if (!fp)
+		return -1;
+
+	fwrite(&t->num_keys, sizeof(int), 1, fp);
+	for (i = 0; i < (int)t->num_keys; ++i) {
+		char type = (char)t->types[i];
+		fwrite(t->rows + i, sizeof(int), 1, fp);
+		fwrite(t->values + i, sizeof(float), 1, fp);
+		fwrite(&type, sizeof(char), 1, fp);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+static void write_padding(FILE *fp, uint32_t *pos, uint32_t offset)
+{
+	static const char zero[PACK_ALIGN];
+	assert(offset >= *pos && offset - *pos <= PACK_ALIGN);
+	fwrite(zero, 1, offset - *pos, fp);
+	*pos = offset;
+}
+
+static void write_blob(FILE *fp, uint32_t *pos, const void *ptr,
+    size_t size)
+{
+	fwrite(ptr, 1, size, fp);
+	*pos += (uint32_t)size;
+}
+
+static void *alloc_zeroed(const struct sync_device *d, size_t size)
+{
+	void *ptr = sync_malloc(d->alloc, size + 1);
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+/* compact encoding, followed by the LZ stage if that pays off */
+static unsigned char *compact_track(const struct sync_track *t,
+    int compress, struct pack_entry *e)
+{
+	unsigned char *raw, *lz;
+	size_t size;
+
+	raw = sync_malloc(t->alloc, sync_compact_bound(t->num_keys));
+	if (!raw)
+		return NULL;
+	size = sync_compact_keys(t, raw);
+	e->keys_size = e->raw_size = (uint32_t)size;
+	if (!compress)
+		return raw;
+
+	lz = sync_malloc(t->alloc, sync_lz_bound(size));
+	if (lz) {
+		size = sync_lz_compress(raw, e->raw_size, lz);
+		if (size < e->raw_size) {
+			sync_free(t->alloc, raw);
+			e->keys_size = (uint32_t)size;
+			return lz;
+		}
+		sync_free(t->alloc, lz);
+	}
+	return raw;
+}
+
+static int save_pack(const struct sync_device *d, const char *path)
+{
+	struct pack_header h;
+	struct pack_entry *entries;
+	unsigned char **blobs = NULL;
+	uint32_t *sizes = NULL;
+	uint32_t pos, offset, mask;
+	size_t i;
+	int ret = -1;
+	FILE *fp = NULL;
+
+	memcpy(h.magic, PACK_MAGIC, 4);
+	h.version = PACK_VERSION;
+	h.flags = d->save_flags & (SYNC_SAVE_COMPACT | SYNC_SAVE_COMPRESS) ?
+	    PACK_COMPACT : 0;
+	h.num_tracks = (uint32_t)d->num_tracks;
+	h.names_size = 0;
+	for (h.num_slots = 1; h.num_slots < d->num_tracks * 2; h.num_slots *= 2)
+		;
+	for (i = 0; i < d->num_tracks; ++i)
+		h.names_size += (uint32_t)strlen(d->tracks[i]->name) + 1;
+
+	entries = alloc_zeroed(d, sizeof(*entries) * h.num_slots);
+	if (h.flags & PACK_COMPACT) {
+		blobs = alloc_zeroed(d, sizeof(*blobs) * d->num_tracks);
+		sizes = alloc_zeroed(d, sizeof(*sizes) * d->num_tracks);
+		if (!blobs || !sizes)
+			goto out;
+	}
+	if (!entries)
+		goto out;
+
+	/* lay out the directory and the blobs, in track order */
+	mask = h.num_slots - 1;
+	offset = pack_align(sizeof(h) + sizeof(*entries) * h.num_slots +
+	    h.names_size);
+	for (i = 0, pos = 0; i < d->num_tracks; ++i) {
+		const struct sync_track *t = d->tracks[i];
+		struct pack_entry *e;
+		uint32_t slot;
+
+		for (slot = t->hash & mask; entries[slot].keys_offset;
+		    slot = (slot + 1) & mask)
+			;
+		e = entries + slot;
+		e->hash = t->hash;
+		e->name_offset = pos;
+		e->num_keys = t->num_keys;
+		e->keys_offset = offset;
+		pos += (uint32_t)strlen(t->name) + 1;
+
+		if (h.flags & PACK_COMPACT) {
+			blobs[i] = compact_track(t,
+			    d->save_flags & SYNC_SAVE_COMPRESS, e);
+			if (!blobs[i])
+				goto out;
+			sizes[i] = e->keys_size;
+			offset += e->keys_size;
+			continue;
+		}
+
+		e->keys_size = e->raw_size =
+		    (uint32_t)pack_keys_size(t->num_keys);
+		offset = pack_align(offset + e->keys_size);
+	}
+
+	fp = fopen(path, "wb");
+	if (!fp)
+		goto out;
+
+	pos = 0;
+	write_blob(fp, &pos, &h, sizeof(h));
+	write_blob(fp, &pos, entries, sizeof(*entries) * h.num_slots);
+	for (i = 0; i < d->num_tracks; ++i)
+		write_blob(fp, &pos, d->tracks[i]->name,
+		    strlen(d->tracks[i]->name) + 1);
+
+	if (h.flags & PACK_COMPACT) {
+		write_padding(fp, &pos, pack_align(pos));
+		for (i = 0; i < d->num_tracks; ++i)
+			write_blob(fp, &pos, blobs[i], sizes[i]);
+	}
+
+	for (i = 0; !(h.flags & PACK_COMPACT) && i < d->num_tracks; ++i) {
+		const struct sync_track *t = d->tracks[i];
+		size_t offsets[4];
+		uint32_t base = pack_align(pos);
+
+		sync_key_layout(t->num_keys, offsets);
+		write_padding(fp, &pos, base);
+		write_blob(fp, &pos, t->rows, sizeof(int) * t->num_keys);
+		write_padding(fp, &pos, base + (uint32_t)offsets[1]);
+		write_blob(fp, &pos, t->values, sizeof(float) * t->num_keys);
+		write_padding(fp, &pos, base + (uint32_t)offsets[2]);
+		write_blob(fp, &pos, t->types, t->num_keys);
+		write_padding(fp, &pos, base + (uint32_t)offsets[3]);
+	}
+	ret = 0;
+
+out:
+	for (i = 0; blobs && i < d->num_tracks; ++i)
+		sync_free(d->alloc, blobs[i]);
+	sync_free(d->alloc, blobs);
+	sync_free(d->alloc, sizes);
+	sync_free(d->alloc, entries);
+	if (fp)
+		fclose(fp);
+	return ret;
+}
+
+void sync_save_tracks(const struct sync_device *d)
+{
+	int i;
+	if (d->save_flags &
+	    (SYNC_SAVE_PACKED | SYNC_SAVE_COMPACT | SYNC_SAVE_COMPRESS))
+		save_pack(d, sync_pack_path(d->base));
+	if (!(d->save_flags & SYNC_SAVE_TRACKS))
+		return;
+
+	for (i = 0; i < (int)d->num_tracks; ++i) {
+		const struct sync_track *t = d->tracks[i];
+		save_track(t, sync_track_path(d->base, t->name));
+	}
+}
+
+void sync_set_save_flags(struct sync_device *d, int flags)
+{
+	d->save_flags = flags;
+}
+
+static int flush_requests(struct sync_device *d)
+{
+	size_t len = d->send_len;
+
+	d->send_len = 0;
+	if (!len || !xsend(d->sock, d->send_buf, len, 0))
+		return 0;
+	close_connection(d);
+	return -1;
+}
+
+/* FNV-1a over the keys as they are sent by SET_KEY, see the editor */
+static uint32_t hash_keys(const struct sync_track *t)
+{
+	uint32_t hash = 2166136261u;
+	int i, j;
+
+	for (i = 0; i < t->num_keys; ++i) {
+		unsigned char key[9];
+		union {
+			float f;
+			uint32_t i;
+		} v;
+		uint32_t row = htonl((uint32_t)t->rows[i]);
+
+		v.f = t->values[i];
+		v.i = htonl(v.i);
+		memcpy(key, &row, 4);
+		memcpy(key + 4, &v.i, 4);
+		key[8] = t->types[i];
+		for (j = 0; j < 9; ++j) {
+			hash ^= key[j];
+			hash *= 16777619u;
+		}
+	}
+	return hash;
+}
+
+/*
+ * Queue a GET_TRACK, the caller flushes once all are queued. When the
+ * editor knows GET_TRACK_HASH, keys we already have are sent along as
+ * a count and a hash instead, so the editor can skip matching tracks.
+ */
+static int fetch_track_data(struct sync_device *d, struct sync_track *t)
+{
+	size_t len = strlen(t->name);
+	unsigned char head[5], tail[8];
+	size_t tail_len = 0;
+	uint32_t v;
+
+	assert(len <= UINT32_MAX);
+	head[0] = GET_TRACK;
+	v = htonl((uint32_t)len);
+	memcpy(head + 1, &v, 4);
+	if (d->hashes && t->num_keys) {
+		head[0] = GET_TRACK_HASH;
+		v = htonl((uint32_t)t->num_keys);
+		memcpy(tail, &v, 4);
+		v = htonl(hash_keys(t));
+		memcpy(tail + 4, &v, 4);
+		tail_len = 8;
+	}
+
+	if (d->send_len + sizeof(head) + len + tail_len > SEND_BUFFER_SIZE &&
+	    flush_requests(d))
+		return -1;
+
+	if (sizeof(head) + len + tail_len > SEND_BUFFER_SIZE) {
+		/* too long to buffer, send it as it is */
+		if (xsend(d->sock, head, sizeof(head), 0) ||
+		    xsend(d->sock, t->name, len, 0) ||
+		    xsend(d->sock, tail, tail_len, 0)) {
+			close_connection(d);
+			return -1;
+		}
+		return 0;
+	}
+
+	memcpy(d->send_buf + d->send_len, head, sizeof(head));
+	memcpy(d->send_buf + d->send_len + sizeof(head), t->name, len);
+	memcpy(d->send_buf + d->send_len + sizeof(head) + len, tail, tail_len);
+	d->send_len += sizeof(head) + len + tail_len;
+	return 0;
+}
+
+static int commit_edits(struct sync_device *d)
+{
+	int i, ret = 0;
+	for (i = 0; i < (int)d->num_tracks; ++i)
+		if (d->tracks[i]->editing &&
+		    sync_track_commit_edit(d->tracks[i]))
+			ret = -1;
+	return ret;
+}
+
+/*
+ * Note rows start to end as changed in this update. A key only shapes the
+ * segments on either side of it, so an edit at a row touches the rows
+ * between the keys around it, and the queued edits of an update can all
+ * be measured against the keys from before it.
+ */
+static int mark_dirty(struct sync_device *d, struct sync_track *t,
+    int start, int end)
+{
+	if (!d->version_open) {
+		d->version++;
+		d->version_open = 1;
+	}
+	sync_free_bake(t);
+
+	/* already listed if the callbacks have not seen its last change */
+	if (t->version != d->version &&
+	    (long)(t->version - d->notified) > 0)
+		t->version = d->version;
+	else if (t->version != d->version) {
+		if (d->num_changed == d->max_changed) {
+			size_t max = d->max_changed ? d->max_changed * 2 : 16;
+			const struct sync_track **changed = sync_realloc(
+			    d->alloc, (void *)d->changed, sizeof(*changed) * max);
+			if (!changed)
+				return -1;
+			d->changed = changed;
+			d->max_changed = max;
+		}
+		d->changed[d->num_changed++] = t;
+		t->dirty_since = t->version;
+		t->version = d->version;
+		t->dirty_start = start;
+		t->dirty_end = end;
+		return 0;
+	}
+	if (start < t->dirty_start)
+		t->dirty_start = start;
+	if (end > t->dirty_end)
+		t->dirty_end = end;
+	return 0;
+}
+
+static int mark_key_dirty(struct sync_device *d, struct sync_track *t,
+    int row)
+{
+	int idx = sync_find_key(t, row), prev, next;
+	if (idx >= 0) {
+		prev = idx - 1;
+		next = idx + 1;
+	} else {
+		prev = -idx - 2;
+		next = -idx - 1;
+	}
+	return mark_dirty(d, t, prev >= 0 ? t->rows[prev] : INT_MIN,
+	    next < t->num_keys ? t->rows[next] : INT_MAX);
+}
+
+/* tell the callbacks about the tracks marked since the last call */
+static void notify_changes(struct sync_device *d, struct sync_cb *cb,
+    void *cb_param)
+{
+	size_t i;
+
+	if (cb && cb->key_changed)
+		for (i = 0; i < d->num_changed; ++i)
+			cb->key_changed(cb_param, d->changed[i],
+			    d->changed[i]->dirty_start,
+			    d->changed[i]->dirty_end);
+	if (cb && cb->keys_changed && d->num_changed)
+		cb->keys_changed(cb_param, d->changed, d->num_changed);
+	d->num_changed = 0;
+	d->version_open = 0;
+	d->notified = d->version;
+}
+
+static int handle_command(struct sync_device *d, const struct sync_cmd *c,
+    struct sync_cb *cb, void *cb_param)
+{
+	struct track_key key;
+
+	switch (c->cmd) {
+	case SET_KEY:
+		assert(c->type < KEY_TYPE_COUNT);
+		assert(c->track < d->num_tracks);
+		if (mark_key_dirty(d, d->tracks[c->track], c->row))
+			return -1;
+		key.row = c->row;
+		key.value = c->value;
+		key.type = (enum key_type)c->type;
+
+		/* collect the keys, they get merged after the update */
+		sync_track_begin_edit(d->tracks[c->track]);
+		return sync_set_key(d->tracks[c->track], &key);
+	case DELETE_KEY:
+		assert(c->track < d->num_tracks);
+		if (mark_key_dirty(d, d->tracks[c->track], c->row))
+			return -1;
+		sync_track_begin_edit(d->tracks[c->track]);
+		return sync_del_key(d->tracks[c->track], c->row);
+	case SET_ROW:
+		if (cb && cb->set_row)
+			cb->set_row(cb_param, c->row);
+		break;
+	case PAUSE:
+		if (cb && cb->pause)
+			cb->pause(cb_param, c->type);
+		break;
+	case SAVE_TRACKS:
+		if (commit_edits(d))
+			return -1;
+		sync_save_tracks(d);
+		break;
+	case CLEAR_TRACK:
+		assert(c->track < d->num_tracks);
+		if (mark_dirty(d, d->tracks[c->track], INT_MIN, INT_MAX))
+			return -1;
+
+		/* like the keys that follow, applied after the update */
+		sync_track_begin_edit(d->tracks[c->track]);
+		sync_clear_keys(d->tracks[c->track]);
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
+
+/* microseconds on some clock, for command budgets */
+static unsigned long clock_usec(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	/* split up, the counter times 10^6 overflows after a few days */
+	return (unsigned long)(now.QuadPart / freq.QuadPart * 1000000 +
+	    now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (unsigned long)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/* the clock is only read every few commands */
+#define BUDGET_CHECK_INTERVAL 16
+
+static int out_of_budget(unsigned long start, unsigned long max_usec,
+    unsigned int count)
+{
+	return max_usec && !(count % BUDGET_CHECK_INTERVAL) &&
+	    clock_usec() - start >= max_usec;
+}
+
+/*
+ * Run the complete commands in the receive ring, leave a partial one.
+ * Returns 1 if the budget ran out first.
+ */
+static int handle_commands(struct sync_device *d, struct sync_cb *cb,
+    void *cb_param, unsigned long start, unsigned long max_usec,
+    unsigned int *count)
+{
+	struct sync_cmd c;
+	int ret;
+
+	while ((ret = recv_command(d, &c)) > 0) {
+		if (handle_command(d, &c, cb, cb_param))
+			return -1;
+		if (out_of_budget(start, max_usec, ++*count))
+			return 1;
+	}
+	return ret;
+}
+
+/* complete commands left in the receive ring */
+static int count_commands(const struct sync_device *d)
+{
+	size_t pos = 0;
+	int count = 0;
+
+	while (pos < d->recv_len) {
+		size_t size = command_size(d->recv_buf[(d->recv_pos + pos) &
+		    (RECV_BUFFER_SIZE - 1)]);
+		if (!size || pos + size > d->recv_len)
+			break;
+		pos += size;
+		++count;
+	}
+	return count;
+}
+
+/* set up a connection that has been greeted, and request all tracks */
+static int start_session(struct sync_device *d)
+{
+	int i;
+
+	/* the buffers live as long as the device, for any later reconnect */
+	if (!d->recv_buf)
+		d->recv_buf = arena_alloc(d, RECV_BUFFER_SIZE, 1);
+	if (!d->send_buf)
+		d->send_buf = arena_alloc(d, SEND_BUFFER_SIZE, 1);
+	d->recv_pos = d->recv_len = 0;
+	d->send_len = 0;
+	if (!d->recv_buf || !d->send_buf ||
+	    socket_set_nonblocking(d->sock)) {
+		close_connection(d);
+		return -1;
+	}
+
+	/* without hashes, the editor sends every key again */
+	if (!d->hashes)
+		for (i = 0; i < (int)d->num_tracks; ++i) {
+			if (d->tracks[i]->num_keys &&
+			    mark_dirty(d, d->tracks[i], INT_MIN, INT_MAX)) {
+				close_connection(d);
+				return -1;
+			}
+			sync_free_keys(d->tracks[i]);
+		}
+
+	/* all requests go out together, the sends close the socket on error */
+	for (i = 0; i < (int)d->num_tracks; ++i)
+		if (fetch_track_data(d, d->tracks[i]))
+			return -1;
+	if (flush_requests(d))
+		return -1;
+
+#ifdef USE_NET_THREAD
+	if (d->threaded && start_net_thread(d)) {
+		close_connection(d);
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+int sync_connect(struct sync_device *d, const char *host, unsigned short port)
+{
+	int ret;
+
+	cancel_connect(d);
+	if (d->sock != INVALID_SOCKET)
+		close_connection(d);
+
+	/* editors that don't know the hashes hang up on the greeting */
+	d->hashes = 1;
+	d->sock = server_connect(host, port, CLIENT_GREET_HASHES);
+	if (d->sock == INVALID_SOCKET) {
+		d->hashes = 0;
+		d->sock = server_connect(host, port, CLIENT_GREET);
+		if (d->sock == INVALID_SOCKET)
+			return -1;
+	}
+
+	/*
+	 * Outside of sync_update, so close the version of the keys the
+	 * session dropped here; the next update notifies them.
+	 */
+	ret = start_session(d);
+	d->version_open = 0;
+	return ret;
+}
+
+#define CONNECT_TIMEOUT 2000000 /* usec for connecting and the greeting */
+#define BACKOFF_MIN 250000
+#define BACKOFF_MAX 8000000
+
+int sync_connect_async(struct sync_device *d, const char *host,
+    unsigned short port)
+{
+	char *copy;
+
+	cancel_connect(d);
+	if (d->sock != INVALID_SOCKET)
+		close_connection(d);
+
+	copy = sync_malloc(d->alloc, strlen(host) + 1);
+	if (!copy)
+		return -1;
+	d->conn_host = strcpy(copy, host);
+	d->conn_port = port;
+	d->conn_state = CONN_WAIT;
+	d->conn_time = clock_usec();
+	d->conn_backoff = BACKOFF_MIN;
+	d->conn_plain = 0;
+	return 0;
+}
+
+static int connect_in_progress(void)
+{
+#ifdef WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#elif defined(USE_AMITCP)
+	return Errno() == EINPROGRESS;
+#else
+	return errno == EINPROGRESS;
+#endif
+}
+
+/* 1 once a non-blocking connect has finished, -1 if it failed */
+static int connect_done(SOCKET sock)
+{
+	struct timeval to = { 0, 0 };
+	fd_set wfds, efds;
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	FD_ZERO(&wfds);
+	FD_ZERO(&efds);
+
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable: 4127)
+#endif
+	FD_SET(sock, &wfds);
+	FD_SET(sock, &efds);
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+	if (select((int)sock + 1, NULL, &wfds, &efds, &to) <= 0)
+		return 0;
+	if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len) ||
+	    err || FD_ISSET(sock, &efds))
+		return -1;
+	return 1;
+}
+
+/* start connecting to the next address of the host */
+static SOCKET start_connect(struct sync_device *d)
+{
+	SOCKET sock;
+	const struct sockaddr *sa;
+	int family, sa_len, nodelay = 1;
+
+	if (socket_init())
+		return INVALID_SOCKET;
+
+#ifdef USE_GETADDRINFO
+	if (!d->conn_next) {
+		char port[6];
+		if (d->conn_addrs)
+			freeaddrinfo(d->conn_addrs);
+		d->conn_addrs = NULL;
+		snprintf(port, sizeof(port), "%u", d->conn_port);
+		if (getaddrinfo(d->conn_host, port, 0, &d->conn_addrs) != 0) {
+			d->conn_addrs = NULL;
+			return INVALID_SOCKET;
+		}
+		d->conn_next = d->conn_addrs;
+	}
+	d->conn_curr = d->conn_next;
+	family = d->conn_next->ai_family;
+	sa = d->conn_next->ai_addr;
+	sa_len = (int)d->conn_next->ai_addrlen;
+	d->conn_next = d->conn_next->ai_next;
+#else
+	if (!d->conn_resolved) {
+		struct hostent *he = gethostbyname(d->conn_host);
+		if (!he || he->h_addrtype != AF_INET)
+			return INVALID_SOCKET;
+		d->conn_addr.sin_family = AF_INET;
+		d->conn_addr.sin_port = htons(d->conn_port);
+		memcpy(&d->conn_addr.sin_addr, he->h_addr_list[0],
+		    he->h_length);
+		memset(&d->conn_addr.sin_zero, 0,
+		    sizeof(d->conn_addr.sin_zero));
+		d->conn_resolved = 1;
+	}
+	family = AF_INET;
+	sa = (const struct sockaddr *)&d->conn_addr;
+	sa_len = sizeof(d->conn_addr);
+#endif
+
+	sock = socket(family, SOCK_STREAM, 0);
+	if (sock == INVALID_SOCKET)
+		return INVALID_SOCKET;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&nodelay,
+	    sizeof(nodelay));
+	if (socket_set_nonblocking(sock) ||
+	    (connect(sock, sa, sa_len) < 0 && !connect_in_progress())) {
+		closesocket(sock);
+		return INVALID_SOCKET;
+	}
+	return sock;
+}
+
+/*
+ * Advance sync_connect_async by one step without blocking, apart from
+ * resolving the host name. Returns 0 once connected.
+ */
+static int connect_step(struct sync_device *d)
+{
+	unsigned long now = clock_usec();
+	size_t greet_len = strlen(SERVER_GREET);
+	const char *greet;
+	int ret;
+
+	switch (d->conn_state) {
+	case CONN_WAIT:
+		if ((long)(now - d->conn_time) < 0)
+			return -1;
+		d->conn_sock = start_connect(d);
+		if (d->conn_sock == INVALID_SOCKET)
+			goto fail;
+		d->conn_state = CONN_CONNECTING;
+		d->conn_time = now;
+		return -1;
+
+	case CONN_CONNECTING:
+		ret = connect_done(d->conn_sock);
+		if (ret < 0)
+			goto fail;
+		if (!ret)
+			break;
+		greet = d->conn_plain ? CLIENT_GREET : CLIENT_GREET_HASHES;
+		if (xsend(d->conn_sock, greet, strlen(greet), 0))
+			goto fail;
+		d->conn_state = CONN_GREETING;
+		d->conn_greet_len = 0;
+		/* fall through */
+
+	case CONN_GREETING:
+		ret = (int)recv(d->conn_sock, d->conn_greet + d->conn_greet_len,
+		    (int)(greet_len - d->conn_greet_len), 0);
+		if (ret > 0)
+			d->conn_greet_len += ret;
+		if (!ret || (ret < 0 && !socket_would_block()) ||
+		    (d->conn_greet_len == greet_len &&
+		    strncmp(SERVER_GREET, d->conn_greet, greet_len))) {
+			if (d->conn_plain)
+				goto fail;
+
+			/* an older editor, greet it the old way right away */
+			closesocket(d->conn_sock);
+			d->conn_sock = INVALID_SOCKET;
+			d->conn_state = CONN_WAIT;
+			d->conn_plain = 1;
+#ifdef USE_GETADDRINFO
+			d->conn_next = d->conn_curr;
+#endif
+			return -1;
+		}
+		if (d->conn_greet_len < greet_len)
+			break;
+
+		d->hashes = !d->conn_plain;
+		d->sock = d->conn_sock;
+		d->conn_sock = INVALID_SOCKET;
+		d->conn_state = CONN_NONE;
+#ifdef USE_GETADDRINFO
+		d->conn_next = NULL;
+#endif
+		/* a failed session closed the socket, try again later */
+		if (start_session(d))
+			goto fail;
+		d->conn_backoff = BACKOFF_MIN;
+		return 0;
+
+	default:
 		return -1;
 	}
 
-	return 0;
+	/* still waiting for the editor */
+	if (now - d->conn_time < CONNECT_TIMEOUT)
+		return -1;
+
+fail:
+	if (d->conn_sock != INVALID_SOCKET)
+		closesocket(d->conn_sock);
+	d->conn_sock = INVALID_SOCKET;
+	d->conn_state = CONN_WAIT;
+	d->conn_plain = 0;
+	d->conn_time = now;
+#ifdef USE_GETADDRINFO
+	/* try the other addresses of the host right away */
+	if (d->conn_next)
+		return -1;
+#endif
+	d->conn_time += d->conn_backoff;
+	d->conn_backoff *= 2;
+	if (d->conn_backoff > BACKOFF_MAX)
+		d->conn_backoff = BACKOFF_MAX;
+	return -1;
 }
 
-static int handle_set_key_cmd(SOCKET sock, struct sync_device *data)
+int sync_update_budget(struct sync_device *d, int row, struct sync_cb *cb,
+    void *cb_param, unsigned long max_usec)
 {
-	uint32_t track, row;
-	union {
-		float f;
-		uint32_t i;
-	} v;
-	struct track_key key;
-	unsigned char type;
+	unsigned long start = max_usec ? clock_usec() : 0;
+	unsigned int count = 0;
+	int pending;
 
-	if (xrecv(sock, (char *)&track, sizeof(track), 0) ||
-	    xrecv(sock, (char *)&row, sizeof(row), 0) ||
-	    xrecv(sock, (char *)&v.i, sizeof(v.i), 0) ||
-	    xrecv(sock, (char *)&type, 1, 0))
+	if (d->sock == INVALID_SOCKET &&
+	    (d->conn_state == CONN_NONE || connect_step(d)))
 		return -1;
 
-	track = ntohl(track);
-	v.i = ntohl(v.i);
+#ifdef USE_NET_THREAD
+	if (d->net_running) {
+		/* the thread decoded these, take what was there at the start */
+		struct sync_cmd c;
+		size_t n = load_acquire(&d->net_tail) - d->net_head;
+		while (n-- && net_pop(d, &c)) {
+			if (c.cmd == NET_CLOSED ||
+			    handle_command(d, &c, cb, cb_param))
+				goto sockerr;
+			if (out_of_budget(start, max_usec, ++count))
+				break;
+		}
+		pending = (int)(load_acquire(&d->net_tail) - d->net_head);
+	} else
+#endif
+	{
+		/* drain the socket, a full ring just means another round */
+		for (;;) {
+			int ret = recv_pending(d), stop;
+			if (ret < 0)
+				goto sockerr;
+			stop = handle_commands(d, cb, cb_param, start, max_usec,
+			    &count);
+			if (stop < 0)
+				goto sockerr;
+			if (stop || !ret)
+				break;
+		}
+		pending = count_commands(d);
+	}
+
+	if (commit_edits(d))
+		goto sockerr;
+	publish_tracks(d);
+	notify_changes(d, cb, cb_param);
+
+	if (cb && cb->is_playing && cb->is_playing(cb_param)) {
+		if (d->row != row && d->sock != INVALID_SOCKET) {
+			unsigned char cmd = SET_ROW;
+			uint32_t nrow = htonl(row);
+			if (xsend(d->sock, (char*)&cmd, 1, 0) ||
+			    xsend(d->sock, (char*)&nrow, sizeof(nrow), 0))
+				goto sockerr;
+			d->row = row;
+		}
+	}
+	return pending;
 
-	key.row = ntohl(row);
-	key.value = v.f;
+sockerr:
+	commit_edits(d);
+	publish_tracks(d);
+	notify_changes(d, cb, cb_param);
+	close_connection(d);
+	if (d->conn_host) {
+		/* sync_connect_async keeps trying, starting right away */
+		d->conn_state = CONN_WAIT;
+		d->conn_time = clock_usec();
+		d->conn_plain = 0;
+	}
+	return -1;
+}
 
-	assert(type < KEY_TYPE_COUNT);
-	assert(track < data->num_tracks);
-	key.type = (enum key_type)type;
-	return sync_set_key(data->tracks[track], &key);
+int sync_update(struct sync_device *d, int row, struct sync_cb *cb,
+    void *cb_param)
+{
+	return sync_update_budget(d, row, cb, cb_param, 0) < 0 ? -1 : 0;
 }
 
-static int handle_del_key_cmd(SOCKET sock, struct sync_device *data)
+#endif /* !defined(SYNC_PLAYER) */
+
+static int create_track(struct sync_device *d, const char *name)
 {
-	uint32_t track, row;
+	struct sync_track *t;
+	char *str;
+	assert(find_track(d, name) < 0);
 
-	if (xrecv(sock, (char *)&track, sizeof(track), 0) ||
-	    xrecv(sock, (char *)&row, sizeof(row), 0))
+	if (d->num_tracks == d->max_tracks &&
+	    reserve_tracks(d, d->max_tracks ? d->max_tracks * 2 : 16))
 		return -1;
 
-	track = ntohl(track);
-	row = ntohl(row);
+	t = arena_alloc(d, sizeof(*t), sizeof(void *));
+	str = arena_alloc(d, strlen(name) + 1, 1);
+	if (!t || !str)
+		return -1;
+
+	memset(t, 0, sizeof(*t));
+	t->alloc = d->alloc;
+	t->name = strcpy(str, name);
+	t->hash = sync_hash_name(name);
+	t->id = (int)d->num_tracks;
 
-	assert(track < data->num_tracks);
-	return sync_del_key(data->tracks[track], row);
+	d->hints[d->num_tracks] = -1;
+	d->tracks[d->num_tracks++] = t;
+	place_track_slot(d, (int)d->num_tracks - 1);
+
+	return (int)d->num_tracks - 1;
 }
 
-int sync_connect(struct sync_device *d, const char *host, unsigned short port)
+/*
+ * Forget the tracks created since there were num_tracks, after a failed
+ * load. Their structs and names stay in the arena until the device goes.
+ */
+static void drop_tracks(struct sync_device *d, size_t num_tracks)
 {
-	int i;
-	if (d->sock != INVALID_SOCKET)
-		closesocket(d->sock);
+	size_t i;
+
+	while (d->num_tracks > num_tracks)
+		sync_free_keys(d->tracks[--d->num_tracks]);
+	for (i = 0; i < d->num_slots; ++i)
+		d->track_slots[i] = -1;
+	for (i = 0; i < d->num_tracks; ++i)
+		place_track_slot(d, (int)i);
+}
 
-	d->sock = server_connect(host, port);
-	if (d->sock == INVALID_SOCKET)
+static int skip_bytes(struct sync_device *d, void *fp, uint32_t *pos,
+    uint32_t offset)
+{
+	char temp[PACK_ALIGN];
+	if (offset < *pos)
 		return -1;
 
-	for (i = 0; i < (int)d->num_tracks; ++i) {
-		free(d->tracks[i]->keys);
-		d->tracks[i]->keys = NULL;
-		d->tracks[i]->num_keys = 0;
+	if (d->io_cb.seek && offset - *pos > sizeof(temp)) {
+		if (d->io_cb.seek(fp, (long)(offset - *pos), SEEK_CUR))
+			return -1;
+		*pos = offset;
 	}
 
-	for (i = 0; i < (int)d->num_tracks; ++i) {
-		if (fetch_track_data(d, d->tracks[i])) {
-			closesocket(d->sock);
-			d->sock = INVALID_SOCKET;
+	while (*pos < offset) {
+		size_t n = offset - *pos < sizeof(temp) ?
+		    offset - *pos : sizeof(temp);
+		if (d->io_cb.read(temp, 1, n, fp) != n)
 			return -1;
-		}
+		*pos += (uint32_t)n;
 	}
+	return *pos == offset ? 0 : -1;
+}
+
+static int read_blob(struct sync_device *d, void *fp, uint32_t *pos,
+    void *ptr, size_t size)
+{
+	if (d->io_cb.read(ptr, 1, size, fp) != size)
+		return -1;
+	*pos += (uint32_t)size;
 	return 0;
 }
 
-int sync_update(struct sync_device *d, int row, struct sync_cb *cb,
-    void *cb_param)
+static int entry_cmp(const void *a, const void *b)
 {
-	if (d->sock == INVALID_SOCKET)
+	const struct pack_entry *ea = a, *eb = b;
+	return ea->keys_offset < eb->keys_offset ? -1 :
+	    ea->keys_offset > eb->keys_offset;
+}
+
+/* compact blobs are read and LZ decoded through a single buffer */
+static int alloc_pack_scratch(struct sync_device *d,
+    const struct pack_header *h,
+    const struct pack_entry *entries, size_t num_entries,
+    unsigned char **scratch)
+{
+	size_t i, size = 0, max_size = (size_t)-1;
+	if (!(h->flags & PACK_COMPACT))
+		return 0;
+
+	for (i = 0; i < num_entries; ++i) {
+		const struct pack_entry *e = entries + i;
+		if (!e->keys_offset)
+			continue;
+		/* the sum can wrap with a 32-bit size_t */
+		if ((size_t)e->raw_size >= max_size - e->keys_size)
+			return -1;
+		if (size < (size_t)e->keys_size + e->raw_size)
+			size = (size_t)e->keys_size + e->raw_size;
+	}
+	*scratch = sync_malloc(d->alloc, size + 1);
+	return *scratch ? 0 : -1;
+}
+
+/* undo the LZ stage, if any, into raw, and decode the keys */
+static int expand_pack_track(struct sync_device *d, struct sync_track *t,
+    const struct pack_entry *e, const unsigned char *data,
+    unsigned char *raw)
+{
+	int ret = -1;
+
+	if (alloc_track_keys(d, t, e->num_keys))
 		return -1;
 
-	/* look for new commands */
-	while (socket_poll(d->sock)) {
-		unsigned char cmd = 0, flag;
-		uint32_t new_row;
-		if (xrecv(d->sock, (char *)&cmd, 1, 0))
-			goto sockerr;
+	if (e->raw_size == e->keys_size)
+		ret = sync_expand_keys(t, data, e->keys_size);
+	else if (sync_lz_decompress(data, e->keys_size, raw,
+	    e->raw_size) == e->raw_size)
+		ret = sync_expand_keys(t, raw, e->raw_size);
 
-		switch (cmd) {
-		case SET_KEY:
-			if (handle_set_key_cmd(d->sock, d))
-				goto sockerr;
-			break;
-		case DELETE_KEY:
-			if (handle_del_key_cmd(d->sock, d))
-				goto sockerr;
-			break;
-		case SET_ROW:
-			if (xrecv(d->sock, (char *)&new_row, sizeof(new_row), 0))
-				goto sockerr;
-			if (cb && cb->set_row)
-				cb->set_row(cb_param, ntohl(new_row));
-			break;
-		case PAUSE:
-			if (xrecv(d->sock, (char *)&flag, 1, 0))
-				goto sockerr;
-			if (cb && cb->pause)
-				cb->pause(cb_param, flag);
-			break;
-		case SAVE_TRACKS:
-			sync_save_tracks(d);
-			break;
-		default:
-			fprintf(stderr, "unknown cmd: %02x\n", cmd);
-			goto sockerr;
-		}
+	if (ret) {
+		sync_free_keys(t);
+		return -1;
 	}
+	build_track_index(d, t);
+	return 0;
+}
 
-	if (cb && cb->is_playing && cb->is_playing(cb_param)) {
-		if (d->row != row && d->sock != INVALID_SOCKET) {
-			unsigned char cmd = SET_ROW;
-			uint32_t nrow = htonl(row);
-			if (xsend(d->sock, (char*)&cmd, 1, 0) ||
-			    xsend(d->sock, (char*)&nrow, sizeof(nrow), 0))
-				goto sockerr;
-			d->row = row;
-		}
+static int read_pack_track(struct sync_device *d, void *fp, uint32_t *pos,
+    const struct pack_header *h, const struct pack_entry *e,
+    const char *name, unsigned char *scratch)
+{
+	struct sync_track *t;
+	int idx = find_track(d, name);
+
+	if (skip_bytes(d, fp, pos, e->keys_offset))
+		return -1;
+
+	if (idx < 0 && (idx = create_track(d, name)) < 0)
+		return -1;
+	t = d->tracks[idx];
+
+	/* keep keys that were already loaded from somewhere else */
+	if (t->key_mem || t->mapped)
+		return skip_bytes(d, fp, pos, e->keys_offset + e->keys_size);
+
+	if (h->flags & PACK_COMPACT)
+		return read_blob(d, fp, pos, scratch, e->keys_size) ? -1 :
+		    expand_pack_track(d, t, e, scratch,
+		    scratch + e->keys_size);
+
+	if (alloc_track_keys(d, t, e->num_keys) ||
+	    read_blob(d, fp, pos, t->rows, e->keys_size)) {
+		sync_free_keys(t);
+		return -1;
 	}
+	sync_update_polys(t, 0, t->num_keys);
+	build_track_index(d, t);
 	return 0;
+}
 
-sockerr:
-	closesocket(d->sock);
-	d->sock = INVALID_SOCKET;
-	return -1;
+/* the directory and the names fit in a file of size bytes */
+static int pack_header_fits(const struct pack_header *h, size_t size)
+{
+	if (size < sizeof(*h))
+		return 0;
+	size -= sizeof(*h);
+	return h->num_slots <= size / sizeof(struct pack_entry) &&
+	    h->names_size <= size - sizeof(struct pack_entry) * h->num_slots;
 }
 
-#endif /* !defined(SYNC_PLAYER) */
+static int pack_header_valid(const struct pack_header *h)
+{
+	return !memcmp(h->magic, PACK_MAGIC, 4) &&
+	    h->version == PACK_VERSION && !(h->flags & ~PACK_COMPACT) &&
+	    h->num_slots && !(h->num_slots & (h->num_slots - 1)) &&
+	    h->num_tracks <= h->num_slots;
+}
 
-static int create_track(struct sync_device *d, const char *name)
+/*
+ * Set aside room for everything a packed export adds to the arena, so
+ * that loading it takes a single block.
+ */
+static int reserve_pack(struct sync_device *d, const struct pack_header *h,
+    const struct pack_entry *entries, size_t num_entries, int mapped)
+{
+	size_t i, num_tracks = d->num_tracks + h->num_tracks, size;
+	int with_keys = !mapped || (h->flags & PACK_COMPACT);
+	int with_polys = !with_keys;
+
+	size = (sizeof(struct sync_track *) + sizeof(int)) * num_tracks +
+	    sizeof(int) * track_slots_for(num_tracks) +
+	    (sizeof(struct sync_track) + sizeof(void *)) * h->num_tracks +
+	    h->names_size + 2 * sizeof(void *);
+
+#ifndef SYNC_PLAYER
+	with_keys = 0; /* the client edits keys, they stay on the heap */
+#endif
+	for (i = 0; i < num_entries && (with_keys || with_polys); ++i) {
+		const struct pack_entry *e = entries + i;
+		size_t offsets[4];
+		if (!e->keys_offset)
+			continue;
+
+		if (with_polys) {
+			size += sizeof(struct track_poly) * e->num_keys +
+			    KEY_ALIGN;
+			if (e->num_keys >= INDEX_MIN_KEYS)
+				size += sizeof(int) * (e->num_keys + 1);
+			continue;
+		}
+
+		size += sync_key_layout(e->num_keys, offsets) + KEY_ALIGN;
+		if (e->num_keys >= INDEX_MIN_KEYS)
+			size += sizeof(int) * (e->num_keys + 1);
+	}
+
+	if (arena_reserve(d, size))
+		return -1;
+	return reserve_tracks(d, num_tracks);
+}
+
+/*
+ * Everything in an entry comes from the file, so check it against the
+ * size of the file before anything gets allocated from it. Sums are
+ * kept from wrapping, since size_t might be 32 bits.
+ */
+static int pack_entry_valid(const struct pack_header *h,
+    const struct pack_entry *e, size_t size)
+{
+	if (e->num_keys > sync_max_keys() || e->keys_offset > size ||
+	    e->keys_size > size - e->keys_offset)
+		return 0;
+
+	/* every key takes at least a byte to encode */
+	if (h->flags & PACK_COMPACT)
+		return e->num_keys <= e->raw_size &&
+		    e->raw_size / PACK_MAX_EXPANSION <= e->keys_size;
+	return !(e->keys_offset & (PACK_ALIGN - 1)) &&
+	    e->keys_size == pack_keys_size(e->num_keys) &&
+	    e->raw_size == e->keys_size;
+}
+
+static int map_pack_track(struct sync_device *d,
+    const struct pack_header *h, const struct pack_entry *e,
+    const char *name, unsigned char *scratch)
 {
+	const char *base = (const char *)d->pack_map + e->keys_offset;
+	struct track_poly *polys;
 	struct sync_track *t;
-	assert(find_track(d, name) < 0);
+	int idx = find_track(d, name), shift, num_buckets;
+
+	if (idx < 0 && (idx = create_track(d, name)) < 0)
+		return -1;
+	t = d->tracks[idx];
+	if (t->key_mem || t->mapped)
+		return 0;
+
+	if (h->flags & PACK_COMPACT)
+		return expand_pack_track(d, t, e,
+		    (const unsigned char *)base, scratch);
+
+	/*
+	 * Point straight into the mapping, read-only. The polys and the
+	 * jump table are derived from the keys rather than trusted from the
+	 * file, and live in the arena as long as the mapping does.
+	 */
+	polys = arena_alloc(d, sizeof(*polys) * e->num_keys, KEY_ALIGN);
+	if (!polys)
+		return -1;
+	sync_place_keys(t, (void *)base, e->num_keys);
+	t->polys = polys;
+	sync_update_polys(t, 0, t->num_keys);
+
+	num_buckets = sync_index_size(t, &shift);
+	if (num_buckets) {
+		int *buckets = arena_alloc(d, sizeof(int) * num_buckets,
+		    sizeof(int));
+		if (!buckets)
+			return -1;
+		sync_place_index(t, buckets, num_buckets, shift);
+	}
+	return 0;
+}
+
+static const struct pack_entry *map_pack_find(const struct pack_header *h,
+    const struct pack_entry *entries, const char *names, const char *name)
+{
+	uint32_t i, mask = h->num_slots - 1;
+	uint32_t slot = sync_hash_name(name) & mask;
+	for (i = 0; i < h->num_slots; ++i, slot = (slot + 1) & mask) {
+		if (!entries[slot].keys_offset)
+			break;
+		if (names + entries[slot].name_offset == name)
+			return entries + slot;
+	}
+	return NULL;
+}
 
-	t = malloc(sizeof(*t));
-	t->name = strdup(name);
-	t->keys = NULL;
-	t->num_keys = 0;
+static int map_pack(struct sync_device *d)
+{
+	const struct pack_header *h;
+	const struct pack_entry *entries;
+	const char *names, *name;
+	unsigned char *scratch = NULL;
+	size_t i, num_tracks = d->num_tracks;
+	int pass, ret = -1;
+
+	d->pack_map = d->io_cb.map(sync_pack_path(d->base),
+	    &d->pack_map_size);
+	if (!d->pack_map)
+		return -1;
+
+	h = (const struct pack_header *)d->pack_map;
+	entries = (const struct pack_entry *)(h + 1);
+	names = (const char *)(entries + h->num_slots);
+	if (!pack_header_fits(h, d->pack_map_size) || !pack_header_valid(h) ||
+	    (h->names_size && names[h->names_size - 1] != '\0'))
+		goto fail;
+
+	for (i = 0; i < h->num_slots; ++i)
+		if (entries[i].keys_offset &&
+		    !pack_entry_valid(h, entries + i, d->pack_map_size))
+			goto fail;
+
+	/*
+	 * The name table is in track order, so walking it keeps that order.
+	 * Validate everything before creating any tracks.
+	 */
+	for (pass = 0; pass < 2; ++pass) {
+		if (pass && (reserve_pack(d, h, entries, h->num_slots, 1) ||
+		    alloc_pack_scratch(d, h, entries, h->num_slots,
+		    &scratch)))
+			goto fail;
+		for (name = names; name < names + h->names_size;
+		    name += strlen(name) + 1) {
+			const struct pack_entry *e = map_pack_find(h, entries,
+			    names, name);
+			if (!pass && !e)
+				goto fail;
+			if (pass && map_pack_track(d, h, e, name, scratch))
+				goto fail;
+		}
+	}
+	ret = 0;
 
-	d->num_tracks++;
-	d->tracks = realloc(d->tracks, sizeof(d->tracks[0]) * d->num_tracks);
-	d->tracks[d->num_tracks - 1] = t;
+	/* decoded tracks do not refer to the mapping */
+	if (!(h->flags & PACK_COMPACT)) {
+		sync_free(d->alloc, scratch);
+		return 0;
+	}
 
-	return (int)d->num_tracks - 1;
+fail:
+	sync_free(d->alloc, scratch);
+	if (ret) {
+		/* nothing may point into the mapping once it is gone */
+		drop_tracks(d, num_tracks);
+		for (i = 0; i < d->num_tracks; ++i) {
+			const char *keys = (const char *)d->tracks[i]->rows;
+			if (d->tracks[i]->mapped &&
+			    keys >= (const char *)d->pack_map &&
+			    keys < (const char *)d->pack_map + d->pack_map_size)
+				sync_free_keys(d->tracks[i]);
+		}
+	}
+	if (d->io_cb.unmap)
+		d->io_cb.unmap(d->pack_map, d->pack_map_size);
+	d->pack_map = NULL;
+	return ret;
 }
 
-const struct sync_track *sync_get_track(struct sync_device *d,
-    const char *name)
+static int read_pack(struct sync_device *d)
+{
+	struct pack_header h;
+	struct pack_entry *entries = NULL;
+	char *names = NULL;
+	unsigned char *scratch = NULL;
+	uint32_t i, n, pos = 0;
+	size_t num_tracks = d->num_tracks, size = (size_t)-1;
+	int ret = -1;
+	void *fp = d->io_cb.open(sync_pack_path(d->base), "rb");
+	if (!fp)
+		return -1;
+
+	/* without a size hook, reads past the end fail instead */
+	if (d->io_cb.size) {
+		long file_size = d->io_cb.size(fp);
+		if (file_size < 0)
+			goto out;
+		size = (size_t)file_size;
+	}
+	if (read_blob(d, fp, &pos, &h, sizeof(h)) || !pack_header_valid(&h) ||
+	    !pack_header_fits(&h, size))
+		goto out;
+
+	entries = sync_malloc(d->alloc, sizeof(*entries) * h.num_slots);
+	names = sync_malloc(d->alloc, h.names_size + 1);
+	if (!entries || !names ||
+	    read_blob(d, fp, &pos, entries, sizeof(*entries) * h.num_slots) ||
+	    read_blob(d, fp, &pos, names, h.names_size))
+		goto out;
+	names[h.names_size] = '\0';
+
+	/* the blobs are stored in track order, read them sequentially */
+	for (i = n = 0; i < h.num_slots; ++i)
+		if (entries[i].keys_offset)
+			entries[n++] = entries[i];
+	qsort(entries, n, sizeof(*entries), entry_cmp);
+	for (i = 0; i < n; ++i)
+		if (entries[i].name_offset >= h.names_size ||
+		    !pack_entry_valid(&h, entries + i, size))
+			goto out;
+	if (alloc_pack_scratch(d, &h, entries, n, &scratch) ||
+	    reserve_pack(d, &h, entries, n, 0))
+		goto out;
+
+	for (i = 0; i < n; ++i)
+		if (read_pack_track(d, fp, &pos, &h, entries + i,
+		    names + entries[i].name_offset, scratch))
+			goto out;
+	ret = 0;
+
+out:
+	if (ret)
+		drop_tracks(d, num_tracks);
+	sync_free(d->alloc, entries);
+	sync_free(d->alloc, names);
+	sync_free(d->alloc, scratch);
+	d->io_cb.close(fp);
+	return ret;
+}
+
+/* find or load a track, a client only queues the request for its keys */
+static struct sync_track *load_track(struct sync_device *d, const char *name)
 {
 	struct sync_track *t;
 	int idx = find_track(d, name);
 	if (idx >= 0)
 		return d->tracks[idx];
 
+#ifndef SYNC_PLAYER
+	if (d->sock == INVALID_SOCKET)
+#endif
+	{
+		/* a packed export provides all tracks up front */
+		if (d->pack_state == PACK_UNKNOWN) {
+			d->pack_state = (d->io_cb.map && !map_pack(d)) ||
+			    !read_pack(d) ? PACK_LOADED : PACK_ABSENT;
+			idx = find_track(d, name);
+			if (idx >= 0)
+				return d->tracks[idx];
+		}
+	}
+
 	idx = create_track(d, name);
+	if (idx < 0)
+		return NULL;
 	t = d->tracks[idx];
 
 #ifndef SYNC_PLAYER
@@ -511,7 +2608,138 @@ const struct sync_track *sync_get_track(struct sync_device *d,
 		fetch_track_data(d, t);
 	else
 #endif
-		read_track_data(d, t);
+	if (read_track_data(d, t)) {
+		drop_tracks(d, idx);
+		return NULL;
+	}
+
+	return t;
+}
+
+static struct sync_track *get_track(struct sync_device *d, const char *name)
+{
+	struct sync_track *t = load_track(d, name);
+#ifndef SYNC_PLAYER
+	/* readers may only ever see published versions */
+	if (t && d->snapshots && !t->snapshot &&
+	    publish_track(d, t, NULL) < 0)
+		return NULL;
+#endif
+	return t;
+}
 
+const struct sync_track *sync_get_track(struct sync_device *d,
+    const char *name)
+{
+	struct sync_track *t = get_track(d, name);
+#ifndef SYNC_PLAYER
+	if (d->sock != INVALID_SOCKET)
+		flush_requests(d);
+#endif
 	return t;
 }
+
+int sync_get_tracks(struct sync_device *d, const char *const *names,
+    size_t count, const struct sync_track **tracks)
+{
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < count; ++i) {
+		tracks[i] = get_track(d, names[i]);
+		if (!tracks[i])
+			ret = -1;
+	}
+#ifndef SYNC_PLAYER
+	if (d->sock != INVALID_SOCKET && flush_requests(d))
+		ret = -1;
+#endif
+	return ret;
+}
+
+const struct sync_track *sync_get_track_by_hash(struct sync_device *d,
+    unsigned int hash)
+{
+	size_t i, mask = d->num_slots - 1;
+	int idx = -1;
+	if (!d->num_slots)
+		return NULL;
+
+	/* the probe sequence holds every track with this hash */
+	for (i = hash & mask; d->track_slots[i] >= 0; i = (i + 1) & mask) {
+		if (d->tracks[d->track_slots[i]]->hash != hash)
+			continue;
+		if (idx >= 0)
+			return NULL; /* a collision, ask by name */
+		idx = d->track_slots[i];
+	}
+	return idx >= 0 ? d->tracks[idx] : NULL;
+}
+
+size_t sync_get_num_tracks(const struct sync_device *d)
+{
+	return d->num_tracks;
+}
+
+void sync_device_eval(struct sync_device *d, double row,
+    const struct sync_track **tracks, size_t n, float *out)
+{
+	size_t i;
+	for (i = 0; i < n; ++i) {
+		const struct sync_track *t = tracks[i];
+		/* snapshots and other devices' tracks go without a hint */
+		if ((size_t)t->id < d->num_tracks && d->tracks[t->id] == t)
+			out[i] = (float)sync_get_val_near(t,
+			    d->hints + t->id, row);
+		else
+			out[i] = (float)sync_get_val(t, row);
+	}
+}
+
+static int in_run(const struct sync_track *t, double row)
+{
+	return row >= t->run_start && row < t->run_end;
+}
+
+static int track_changed(struct sync_track *t, double from, double to)
+{
+	if (t->run_version != t->version || !in_run(t, to)) {
+		t->run_changing = sync_constant_run(t, (int)floor(to),
+		    &t->run_start, &t->run_end) != 0;
+		t->run_version = t->version;
+	}
+	if (in_run(t, from))
+		return t->run_changing;
+
+	/* across keys, it might still have come back to the same value */
+	return sync_get_val(t, from) != sync_get_val(t, to);
+}
+
+size_t sync_device_changed_tracks(struct sync_device *d, double prev_row,
+    double row, size_t *out)
+{
+	size_t i, n = 0;
+	if (prev_row == row)
+		return 0;
+	for (i = 0; i < d->num_tracks; ++i)
+		if (track_changed(d->tracks[i], prev_row, row))
+			out[n++] = i;
+	return n;
+}
+
+void sync_device_eval_all(struct sync_device *d, double row, float *out)
+{
+	size_t i;
+	for (i = 0; i < d->num_tracks; ++i)
+		out[i] = (float)sync_get_val_near(d->tracks[i], d->hints + i,
+		    row);
+}
+
+int sync_bake_track(struct sync_device *d, const struct sync_track *t,
+    double rows_per_sample, double tolerance)
+{
+	/* the table is a cache in the live track, never in a snapshot */
+	if ((size_t)t->id >= d->num_tracks || d->tracks[t->id] != t)
+		return -1;
+	return sync_bake_keys(d->tracks[t->id], rows_per_sample, tolerance);
+}
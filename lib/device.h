@@ -17,8 +17,13 @@
  #include <ws2tcpip.h>
  #include <windows.h>
  #include <limits.h>
+ #define USE_NET_THREAD
 #elif defined(USE_AMITCP)
  #include <sys/socket.h>
+ #include <sys/ioctl.h>
+ #include <errno.h>
+ #include <netinet/in.h>
+ #include <netinet/tcp.h>
  #include <proto/exec.h>
  #include <proto/socket.h>
  #include <netdb.h>
@@ -30,25 +35,129 @@
  #include <sys/socket.h>
  #include <sys/time.h>
  #include <netinet/in.h>
+ #include <netinet/tcp.h>
  #include <netdb.h>
  #include <unistd.h>
+ #include <fcntl.h>
+ #include <errno.h>
+ #include <pthread.h>
  #define SOCKET int
  #define INVALID_SOCKET -1
  #define closesocket(x) close(x)
+ #define USE_NET_THREAD
 #endif
 
+/* an editor command, decoded from the wire */
+struct sync_cmd {
+	unsigned char cmd;
+	unsigned char type; /* key type, or the PAUSE flag */
+	uint32_t track, row;
+	float value;
+};
+
 #endif /* !defined(SYNC_PLAYER) */
 
+/* configure file mapping */
+#ifdef _WIN32
+ #define USE_WIN32_MAP
+ #ifndef WIN32_LEAN_AND_MEAN
+  #define WIN32_LEAN_AND_MEAN
+ #endif
+ #include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+ #define USE_MMAP
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ #include <fcntl.h>
+ #include <unistd.h>
+#endif
+
+/* blocks of a bump allocator, the data follows each header */
+struct arena_block {
+	struct arena_block *next;
+	size_t size, used;
+};
+
 struct sync_device {
 	char *base;
 	struct sync_track **tracks;
-	size_t num_tracks;
+	size_t num_tracks, max_tracks;
+	int *hints; /* last segment evaluated, per track */
+
+	/* open addressing over the track name hashes, -1 is empty */
+	int *track_slots;
+	size_t num_slots;
+
+	int pack_state; /* PACK_UNKNOWN until we looked for a packed export */
+	const void *pack_map;
+	size_t pack_map_size;
 
 #ifndef SYNC_PLAYER
 	int row;
 	SOCKET sock;
+	int save_flags;
+	int hashes; /* the editor knows GET_TRACK_HASH */
+
+	/* ring of received bytes not yet parsed into commands */
+	unsigned char *recv_buf;
+	size_t recv_pos, recv_len;
+
+	/* requests queued to go out in one send */
+	unsigned char *send_buf;
+	size_t send_len;
+
+	/* sync_connect_async: sync_update connects, and reconnects on errors */
+	char *conn_host;
+	unsigned short conn_port;
+	int conn_state;
+	int conn_plain; /* retrying an editor that hung up on the hashes */
+	SOCKET conn_sock;
+#ifdef USE_GETADDRINFO
+	struct addrinfo *conn_addrs, *conn_next, *conn_curr;
+#else
+	struct sockaddr_in conn_addr;
+	int conn_resolved;
+#endif
+	unsigned long conn_time; /* when the attempt started, or the next one */
+	unsigned long conn_backoff;
+	char conn_greet[16];
+	size_t conn_greet_len;
+
+	/* sync_set_snapshots: published track versions for other threads */
+	int snapshots;
+	volatile unsigned long epoch; /* bumped on every publish */
+	struct track_version *retired;
+
+	unsigned long version; /* see sync_device_version */
+	int version_open; /* bumped for changes not yet notified */
+	unsigned long notified; /* the version the callbacks last saw */
+	const struct sync_track **changed; /* since then */
+	size_t num_changed, max_changed;
+
+#ifdef USE_NET_THREAD
+	/*
+	 * In threaded mode the thread owns the receive ring and feeds the
+	 * command queue; only sync_update consumes from it.
+	 */
+	int threaded, net_running;
+	volatile int net_stop;
+	struct sync_cmd *net_queue;
+	volatile size_t net_head, net_tail;
+#ifdef _WIN32
+	HANDLE net_thread;
+#else
+	pthread_t net_thread;
+#endif
+#endif
 #endif
 	struct sync_io_cb io_cb;
+
+	/* the device itself, tracks and names, and player keys */
+	struct arena_block *arena;
+
+	/* points to alloc_cb, or is NULL to use the C library */
+	const struct sync_alloc_cb *alloc;
+	struct sync_alloc_cb alloc_cb;
 };
 
 #endif /* SYNC_DEVICE_H */
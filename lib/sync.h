@@ -17,28 +17,196 @@ struct sync_track;
 struct sync_device *sync_create_device(const char *);
 void sync_destroy_device(struct sync_device *);
 
+/*
+ * All memory of a device, including the device itself, comes from these
+ * callbacks. The player never calls resize.
+ */
+struct sync_alloc_cb {
+	void *(*alloc)(size_t size, void *param);
+	void *(*resize)(void *ptr, size_t size, void *param);
+	void (*release)(void *ptr, void *param);
+	void *param;
+};
+struct sync_device *sync_create_device_alloc(const char *,
+    const struct sync_alloc_cb *);
+
 #ifndef SYNC_PLAYER
+/*
+ * Members are only ever added at the end, and unused ones must be NULL,
+ * so zero-initialise the struct (= { 0 } or memset) before filling it.
+ */
 struct sync_cb {
 	void (*pause)(void *, int);
 	void (*set_row)(void *, int);
 	int (*is_playing)(void *);
+
+	/*
+	 * Optional, called once the keys an update brought are in place:
+	 * key_changed per changed track with the rows that changed (see
+	 * sync_track_dirty_rows), keys_changed once with all those tracks.
+	 */
+	void (*key_changed)(void *, const struct sync_track *, int, int);
+	void (*keys_changed)(void *, const struct sync_track *const *, size_t);
 };
 #define SYNC_DEFAULT_PORT 1338
 int sync_connect(struct sync_device *, const char *, unsigned short);
+/*
+ * Connect from within sync_update instead, without blocking it, and
+ * reconnect with exponential backoff whenever the connection is lost.
+ * Tracks keep their data while disconnected and are refetched once the
+ * editor is back. sync_update returns -1 while not connected.
+ */
+int sync_connect_async(struct sync_device *, const char *, unsigned short);
 int sync_update(struct sync_device *, int, struct sync_cb *, void *);
+
+/*
+ * Like sync_update, but stop applying editor commands once max_usec
+ * microseconds have passed, 0 for no limit. The rest are applied by the
+ * next call. Returns the number of commands left waiting, or -1.
+ */
+int sync_update_budget(struct sync_device *, int, struct sync_cb *, void *,
+    unsigned long);
 void sync_save_tracks(const struct sync_device *);
+
+/* what sync_save_tracks writes, one .track file per track by default */
+#define SYNC_SAVE_TRACKS 1
+#define SYNC_SAVE_PACKED 2 /* all tracks in a single <base>.pack file */
+#define SYNC_SAVE_COMPACT 4 /* packed, with delta-encoded keys */
+#define SYNC_SAVE_COMPRESS 8 /* compact, plus an LZ stage */
+void sync_set_save_flags(struct sync_device *, int);
+
+/*
+ * Read and decode editor commands on a background thread from the next
+ * sync_connect on; sync_update then only applies them. Returns -1 where
+ * threads are not supported.
+ */
+int sync_set_threaded(struct sync_device *, int);
 #endif /* defined(SYNC_PLAYER) */
 
 struct sync_io_cb {
 	void *(*open)(const char *filename, const char *mode);
 	size_t (*read)(void *ptr, size_t size, size_t nitems, void *stream);
 	int (*close)(void *stream);
+
+	/*
+	 * Optional, set to NULL if unsupported: map a whole file read-only,
+	 * so a packed export can be used in place instead of being read.
+	 */
+	const void *(*map)(const char *filename, size_t *size);
+	void (*unmap)(const void *data, size_t size);
+
+	/* optional, like ftell after seeking to the end, and fseek */
+	long (*size)(void *stream);
+	int (*seek)(void *stream, long offset, int whence);
 };
 void sync_set_io_cb(struct sync_device *d, struct sync_io_cb *cb);
 
+/* NULL if the track cannot be created, or its .track file is damaged */
 const struct sync_track *sync_get_track(struct sync_device *, const char *);
+/*
+ * Get many tracks at once. A connected client requests them from the
+ * editor together. Fails if any of them could not be created, or if
+ * the requests could not be sent, which drops the connection.
+ */
+int sync_get_tracks(struct sync_device *, const char *const *, size_t,
+    const struct sync_track **);
+
+/*
+ * Track names are hashed with 32-bit FNV-1a, so callers can compute the
+ * hashes up front. Looking up a hash never creates a track; it returns
+ * NULL for tracks that have not been requested by name yet, and when
+ * two known names share the hash, since it cannot tell them apart.
+ */
+unsigned int sync_hash_name(const char *);
+const struct sync_track *sync_get_track_by_hash(struct sync_device *,
+    unsigned int);
 double sync_get_val(const struct sync_track *, double);
 
+/*
+ * Each sync_update that changes tracks bumps the device version and
+ * stamps the tracks it changed with it. sync_track_dirty_rows returns 0
+ * if a track is unchanged since the version a caller last saw, else 1
+ * and the rows whose values may differ, from *row_start up to but not
+ * including *row_end. Open ends are INT_MIN and INT_MAX, and so is all
+ * of the track when it changed more than once since then.
+ */
+unsigned long sync_device_version(const struct sync_device *);
+unsigned long sync_track_version(const struct sync_track *);
+int sync_track_dirty_rows(const struct sync_track *, unsigned long, int *,
+    int *);
+
+/*
+ * The first row where the value of a track may differ from the one at
+ * row, or a row at or before row when it is changing there already.
+ * sync_device_changed_tracks writes the indices of the tracks whose
+ * values differ between two rows, in the order of sync_device_eval_all,
+ * and returns how many there are; out must have room for
+ * sync_get_num_tracks of them. It remembers the constant stretch each
+ * track was in, so tracks that hold still cost a comparison. That is
+ * kept in the tracks themselves, so like the eval functions below, only
+ * the thread that updates the device may call it.
+ */
+int sync_track_valid_until(const struct sync_track *, double);
+size_t sync_device_changed_tracks(struct sync_device *, double, double,
+    size_t *);
+
+/* remembers the last key segment, for cheap lookups at nearby rows */
+struct sync_track_cursor {
+	const struct sync_track *track;
+	int idx;
+};
+void sync_cursor_init(struct sync_track_cursor *, const struct sync_track *);
+double sync_cursor_get_val(struct sync_track_cursor *, double);
+
+/*
+ * Evaluate many tracks at once, into a contiguous buffer. The device
+ * remembers where each of its tracks was last evaluated, so only the
+ * thread that updates it may call these.
+ */
+size_t sync_get_num_tracks(const struct sync_device *);
+void sync_device_eval(struct sync_device *, double,
+    const struct sync_track **, size_t, float *);
+void sync_device_eval_all(struct sync_device *, double, float *);
+
+/* sample a track at count rows, starting at row_start */
+void sync_sample_track(const struct sync_track *, double, double, size_t,
+    float *);
+
+/*
+ * Bake a track into a table with a sample every rows_per_sample rows
+ * over its keys, for sync_get_val_baked to interpolate without searching.
+ * Fails if the table strays further than tolerance from sync_get_val,
+ * checked at the keys and between samples; steps bake poorly. Changes
+ * from the editor drop the table, and sync_get_val_baked falls back to
+ * sync_get_val until the track is baked again. Only the device's own
+ * tracks can be baked, not snapshots, and only by the thread that
+ * updates it.
+ */
+int sync_bake_track(struct sync_device *, const struct sync_track *, double,
+    double);
+double sync_get_val_baked(const struct sync_track *, double);
+
+/*
+ * Read tracks from other threads while sync_update edits them. With
+ * snapshots enabled, sync_update publishes a new read-only version of
+ * each track it changed and bumps the device epoch. A reader loads the
+ * epoch, then reads sync_track_snapshot of its tracks; the versions
+ * stay valid until the owner passes a later epoch to
+ * sync_reclaim_snapshots, which frees those replaced before it. The
+ * player never edits tracks, so it always returns the track itself.
+ *
+ * Switching fails when out of memory, and leaves snapshots as they
+ * were: enabling gives every track a version, and disabling copies the
+ * keys back into the live tracks before retiring the versions like an
+ * update does. Without snapshots, sync_track_snapshot returns the live
+ * track, which only the owner may read. A new track that cannot get a
+ * version is not handed out.
+ */
+int sync_set_snapshots(struct sync_device *, int);
+unsigned long sync_device_epoch(const struct sync_device *);
+const struct sync_track *sync_track_snapshot(const struct sync_track *);
+void sync_reclaim_snapshots(struct sync_device *, unsigned long);
+
 #ifdef __cplusplus
 }
 #endif
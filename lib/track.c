@@ -1,61 +1,610 @@
 #include <stdlib.h>
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
 
 #include "sync.h"
 #include "track.h"
 #include "base.h"
 
-static double key_linear(const struct track_key k[2], double row)
+/* configure SIMD kernels for sync_sample_track */
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+ #define USE_SSE2
+ #include <emmintrin.h>
+ #if defined(__clang__) || (defined(__GNUC__) && \
+     (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+  #define USE_AVX2
+  #define AVX2_TARGET __attribute__((target("avx2")))
+  #include <immintrin.h>
+ #elif defined(_MSC_VER) && _MSC_VER >= 1800
+  #define USE_AVX2
+  #define AVX2_TARGET
+  #include <immintrin.h>
+  #include <intrin.h>
+ #endif
+#endif
+
+static void key_poly(struct track_poly *p, const struct sync_track *t,
+    int idx)
 {
-	double t = (row - k[0].row) / (k[1].row - k[0].row);
-	return k[0].value + (k[1].value - k[0].value) * t;
+	/* same basis as the editor's SyncTrack::getPolynomial */
+	double mag = t->values[idx + 1] - t->values[idx];
+	p->coeffs[0] = t->values[idx];
+	p->coeffs[1] = p->coeffs[2] = p->coeffs[3] = 0.0;
+	p->inv_span = 1.0 / (t->rows[idx + 1] - t->rows[idx]);
+
+	switch (t->types[idx]) {
+	case KEY_STEP:
+		break;
+	case KEY_LINEAR:
+		p->coeffs[1] = mag;
+		break;
+	case KEY_SMOOTH:
+		p->coeffs[2] = 3 * mag;
+		p->coeffs[3] = -2 * mag;
+		break;
+	case KEY_RAMP:
+		p->coeffs[2] = mag;
+		break;
+	default:
+		assert(0);
+	}
 }
 
-static double key_smooth(const struct track_key k[2], double row)
+void sync_update_polys(struct sync_track *t, int first, int last)
 {
-	double t = (row - k[0].row) / (k[1].row - k[0].row);
-	t = t * t * (3 - 2 * t);
-	return k[0].value + (k[1].value - k[0].value) * t;
+	int i;
+	if (first < 0)
+		first = 0;
+	if (last > t->num_keys)
+		last = t->num_keys;
+
+	for (i = first; i < last; ++i) {
+		if (i < t->num_keys - 1) {
+			key_poly(t->polys + i, t, i);
+		} else {
+			/* the last key holds its value forever */
+			t->polys[i].coeffs[0] = t->values[i];
+			t->polys[i].coeffs[1] = 0.0;
+			t->polys[i].coeffs[2] = 0.0;
+			t->polys[i].coeffs[3] = 0.0;
+			t->polys[i].inv_span = 0.0;
+		}
+	}
 }
 
-static double key_ramp(const struct track_key k[2], double row)
+static inline double poly_eval(const struct track_poly *p, int key_row,
+    double row)
 {
-	double t = (row - k[0].row) / (k[1].row - k[0].row);
-	t = pow(t, 2.0);
-	return k[0].value + (k[1].value - k[0].value) * t;
+	double t = (row - key_row) * p->inv_span;
+	return p->coeffs[0] +
+	    t * (p->coeffs[1] + t * (p->coeffs[2] + t * p->coeffs[3]));
 }
 
-double sync_get_val(const struct sync_track *t, double row)
+static double key_eval(const struct sync_track *t, int idx, double row)
 {
-	int idx, irow;
+	/* before the first key, return the first value */
+	if (idx < 0)
+		return t->values[0];
+
+	return poly_eval(t->polys + idx, t->rows[idx], row);
+}
 
+double sync_get_val(const struct sync_track *t, double row)
+{
 	/* If we have no keys at all, return a constant 0 */
 	if (!t->num_keys)
 		return 0.0f;
 
-	irow = (int)floor(row);
-	idx = key_idx_floor(t, irow);
+	return key_eval(t, key_idx_floor(t, (int)floor(row)), row);
+}
 
-	/* at the edges, return the first/last value */
-	if (idx < 0)
-		return t->keys[0].value;
-	if (idx > (int)t->num_keys - 2)
-		return t->keys[t->num_keys - 1].value;
+static int poly_is_constant(const struct track_poly *p)
+{
+	return p->coeffs[1] == 0.0 && p->coeffs[2] == 0.0 &&
+	    p->coeffs[3] == 0.0;
+}
 
-	/* interpolate according to key-type */
-	switch (t->keys[idx].type) {
-	case KEY_STEP:
-		return t->keys[idx].value;
-	case KEY_LINEAR:
-		return key_linear(t->keys + idx, row);
-	case KEY_SMOOTH:
-		return key_smooth(t->keys + idx, row);
-	case KEY_RAMP:
-		return key_ramp(t->keys + idx, row);
-	default:
-		assert(0);
+/*
+ * The rows around row where the value holds still, from *start up to
+ * *end, following keys that keep the same value. Returns -1 when the
+ * value moves at row, with the bounds of its segment instead.
+ */
+int sync_constant_run(const struct sync_track *t, int row, int *start,
+    int *end)
+{
+	int idx, i;
+	double val;
+
+	*start = INT_MIN;
+	*end = INT_MAX;
+	if (!t->num_keys)
+		return 0;
+
+	idx = key_idx_floor(t, row);
+	if (idx >= 0 && !poly_is_constant(t->polys + idx)) {
+		*start = t->rows[idx];
+		*end = t->rows[idx + 1];
+		return -1;
+	}
+
+	/* before the first key, it holds the first value */
+	val = idx >= 0 ? t->polys[idx].coeffs[0] : t->values[0];
+	for (i = idx + 1; i < t->num_keys; ++i)
+		if (!poly_is_constant(t->polys + i) ||
+		    t->polys[i].coeffs[0] != val) {
+			*end = t->rows[i];
+			break;
+		}
+	for (i = idx; i > 0; --i)
+		if (!poly_is_constant(t->polys + i - 1) ||
+		    t->polys[i - 1].coeffs[0] != val) {
+			*start = t->rows[i];
+			break;
+		}
+	return 0;
+}
+
+int sync_track_valid_until(const struct sync_track *t, double row)
+{
+	int start, end, r = (int)floor(row);
+	return sync_constant_run(t, r, &start, &end) ? r : end;
+}
+
+unsigned long sync_track_version(const struct sync_track *t)
+{
+	return t->version;
+}
+
+int sync_track_dirty_rows(const struct sync_track *t, unsigned long since,
+    int *row_start, int *row_end)
+{
+	if ((long)(t->version - since) <= 0)
+		return 0;
+
+	if ((long)(t->dirty_since - since) <= 0) {
+		*row_start = t->dirty_start;
+		*row_end = t->dirty_end;
+	} else {
+		/* changed in earlier updates too, we only know the last one */
+		*row_start = INT_MIN;
+		*row_end = INT_MAX;
+	}
+	return 1;
+}
+
+/* how far a cursor walks from its last key before doing a full search */
+#define CURSOR_MAX_WALK 4
+
+static int key_idx_floor_near(const struct sync_track *t, int idx, int row)
+{
+	int i;
+
+	/* the track might have been edited since the last lookup */
+	if (idx < -1 || idx >= t->num_keys)
+		return key_idx_floor(t, row);
+
+	for (i = 0; i < CURSOR_MAX_WALK; ++i) {
+		if (idx >= 0 && t->rows[idx] > row)
+			idx--;
+		else if (idx + 1 < t->num_keys && t->rows[idx + 1] <= row)
+			idx++;
+		else
+			return idx;
+	}
+
+	/* large seek, fall back to binary search */
+	return key_idx_floor(t, row);
+}
+
+double sync_get_val_near(const struct sync_track *t, int *idx, double row)
+{
+	/* If we have no keys at all, return a constant 0 */
+	if (!t->num_keys)
 		return 0.0f;
+
+	*idx = key_idx_floor_near(t, *idx, (int)floor(row));
+	return key_eval(t, *idx, row);
+}
+
+void sync_cursor_init(struct sync_track_cursor *c,
+    const struct sync_track *t)
+{
+	c->track = t;
+	c->idx = -1;
+}
+
+double sync_cursor_get_val(struct sync_track_cursor *c, double row)
+{
+	return sync_get_val_near(c->track, &c->idx, row);
+}
+
+static void sample_segment_scalar(const struct track_poly *p, int key_row,
+    double row_start, double row_step, size_t i, size_t n, float *out)
+{
+	for (; i < n; ++i)
+		out[i] = (float)poly_eval(p, key_row,
+		    row_start + (double)i * row_step);
+}
+
+/*
+ * The SIMD kernels perform exactly the same double precision operations
+ * as the scalar path, in the same order, so the results are identical.
+ */
+
+#ifdef USE_SSE2
+static void sample_segment_sse2(const struct track_poly *p, int key_row,
+    double row_start, double row_step, size_t i, size_t n, float *out)
+{
+	const __m128d start = _mm_set1_pd(row_start);
+	const __m128d step = _mm_set1_pd(row_step);
+	const __m128d r0 = _mm_set1_pd((double)key_row);
+	const __m128d inv_span = _mm_set1_pd(p->inv_span);
+	const __m128d c0 = _mm_set1_pd(p->coeffs[0]);
+	const __m128d c1 = _mm_set1_pd(p->coeffs[1]);
+	const __m128d c2 = _mm_set1_pd(p->coeffs[2]);
+	const __m128d c3 = _mm_set1_pd(p->coeffs[3]);
+	const __m128d two = _mm_set1_pd(2.0);
+	__m128d idx = _mm_set_pd((double)(i + 1), (double)i);
+
+	for (; i + 2 <= n; i += 2) {
+		__m128d row = _mm_add_pd(start, _mm_mul_pd(idx, step));
+		__m128d t = _mm_mul_pd(_mm_sub_pd(row, r0), inv_span);
+		__m128d v = _mm_add_pd(c2, _mm_mul_pd(t, c3));
+		v = _mm_add_pd(c1, _mm_mul_pd(t, v));
+		v = _mm_add_pd(c0, _mm_mul_pd(t, v));
+		_mm_storel_pi((__m64 *)(out + i), _mm_cvtpd_ps(v));
+		idx = _mm_add_pd(idx, two);
+	}
+
+	sample_segment_scalar(p, key_row, row_start, row_step, i, n, out);
+}
+#endif
+
+#ifdef USE_AVX2
+AVX2_TARGET
+static void sample_segment_avx2(const struct track_poly *p, int key_row,
+    double row_start, double row_step, size_t i, size_t n, float *out)
+{
+	const __m256d start = _mm256_set1_pd(row_start);
+	const __m256d step = _mm256_set1_pd(row_step);
+	const __m256d r0 = _mm256_set1_pd((double)key_row);
+	const __m256d inv_span = _mm256_set1_pd(p->inv_span);
+	const __m256d c0 = _mm256_set1_pd(p->coeffs[0]);
+	const __m256d c1 = _mm256_set1_pd(p->coeffs[1]);
+	const __m256d c2 = _mm256_set1_pd(p->coeffs[2]);
+	const __m256d c3 = _mm256_set1_pd(p->coeffs[3]);
+	const __m256d four = _mm256_set1_pd(4.0);
+	__m256d idx = _mm256_set_pd((double)(i + 3), (double)(i + 2),
+	    (double)(i + 1), (double)i);
+
+	for (; i + 4 <= n; i += 4) {
+		__m256d row = _mm256_add_pd(start, _mm256_mul_pd(idx, step));
+		__m256d t = _mm256_mul_pd(_mm256_sub_pd(row, r0), inv_span);
+		__m256d v = _mm256_add_pd(c2, _mm256_mul_pd(t, c3));
+		v = _mm256_add_pd(c1, _mm256_mul_pd(t, v));
+		v = _mm256_add_pd(c0, _mm256_mul_pd(t, v));
+		_mm_storeu_ps(out + i, _mm256_cvtpd_ps(v));
+		idx = _mm256_add_pd(idx, four);
+	}
+
+	sample_segment_sse2(p, key_row, row_start, row_step, i, n, out);
+}
+
+static int cpu_has_avx2(void)
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return 0;
+
+	/* the OS must save the YMM registers, too */
+	__cpuid(info, 1);
+	if (!(info[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+		return 0;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+typedef void (*sample_func)(const struct track_poly *, int, double, double,
+    size_t, size_t, float *);
+
+/* picked on first use, by whichever thread gets there first */
+static sample_func volatile sample_kernel = NULL;
+
+static sample_func select_sample_func(void)
+{
+#ifdef USE_AVX2
+	if (cpu_has_avx2())
+		return sample_segment_avx2;
+#endif
+#ifdef USE_SSE2
+	return sample_segment_sse2;
+#else
+	return sample_segment_scalar;
+#endif
+}
+
+static int key_in_segment(const struct sync_track *t, int idx, double row)
+{
+	return (idx < 0 || row >= t->rows[idx]) &&
+	    (idx + 1 >= t->num_keys || row < t->rows[idx + 1]);
+}
+
+static size_t segment_end(const struct sync_track *t, int idx,
+    double row_start, double row_step, size_t i, size_t count)
+{
+	/* samples are monotonic in row, so gallop to the first one outside */
+	size_t in = i, out = i + 1, step = 1, mid;
+	while (out < count && key_in_segment(t, idx,
+	    row_start + (double)out * row_step)) {
+		in = out;
+		step *= 2;
+		out = in + step;
+	}
+	if (out > count)
+		out = count;
+
+	while (out - in > 1) {
+		mid = in + (out - in) / 2;
+		if (key_in_segment(t, idx, row_start + (double)mid * row_step))
+			in = mid;
+		else
+			out = mid;
+	}
+	return out;
+}
+
+void sync_sample_track(const struct sync_track *t, double row_start,
+    double row_step, size_t count, float *out)
+{
+	sample_func sample_segment = load_acquire(&sample_kernel);
+	size_t i = 0, j;
+	int idx = -1;
+
+	if (!sample_segment) {
+		sample_segment = select_sample_func();
+		store_release(&sample_kernel, sample_segment);
+	}
+
+	while (i < count) {
+		double row = row_start + (double)i * row_step;
+		float value;
+
+		if (!t->num_keys) {
+			value = 0.0f;
+			j = count;
+		} else {
+			idx = key_idx_floor_near(t, idx, (int)floor(row));
+			j = segment_end(t, idx, row_start, row_step, i, count);
+
+			if (idx >= 0) {
+				sample_segment(t->polys + idx, t->rows[idx],
+				    row_start, row_step, i, j, out);
+				i = j;
+				continue;
+			}
+			value = t->values[0];
+		}
+
+		/* constant run */
+		for (; i < j; ++i)
+			out[i] = value;
+	}
+}
+
+void sync_free_bake(struct sync_track *t)
+{
+	sync_free(t->alloc, t->bake);
+	t->bake = NULL;
+	t->bake_count = 0;
+}
+
+static double baked_val(const struct sync_track *t, double row)
+{
+	double x = (row - t->bake_start) * t->bake_inv_step;
+	int i;
+
+	if (x <= 0.0)
+		return t->bake[0];
+	if (x >= t->bake_count - 1)
+		return t->bake[t->bake_count - 1];
+	i = (int)x;
+	return t->bake[i] + (x - i) * (t->bake[i + 1] - t->bake[i]);
+}
+
+static int bake_error(const struct sync_track *t, int *idx, double row,
+    double tolerance)
+{
+	return fabs(baked_val(t, row) - sync_get_val_near(t, idx, row)) >
+	    tolerance;
+}
+
+int sync_bake_keys(struct sync_track *t, double rows_per_sample,
+    double tolerance)
+{
+	double span = 0.0;
+	int i, idx = -1, count;
+
+	sync_free_bake(t);
+	if (rows_per_sample <= 0.0)
+		return -1;
+	if (t->num_keys)
+		span = (double)t->rows[t->num_keys - 1] - t->rows[0];
+	/* the table size must fit an int, and a size_t in bytes */
+	if (span / rows_per_sample >= INT_MAX - 1 ||
+	    span / rows_per_sample >= (double)((size_t)-1 / sizeof(float)) - 1)
+		return -1;
+	count = (int)ceil(span / rows_per_sample) + 1;
+
+	t->bake = sync_malloc(t->alloc, sizeof(float) * count);
+	if (!t->bake)
+		return -1;
+	t->bake_count = count;
+	t->bake_start = t->num_keys ? t->rows[0] : 0.0;
+	t->bake_inv_step = 1.0 / rows_per_sample;
+	sync_sample_track(t, t->bake_start, rows_per_sample, count, t->bake);
+
+	/* keys can fall between samples, and curves bend between them */
+	for (i = 0; i < t->num_keys; ++i)
+		if (bake_error(t, &idx, t->rows[i], tolerance))
+			goto fail;
+	idx = -1;
+	for (i = 0; i + 1 < count; ++i) {
+		double row = t->bake_start + i * rows_per_sample;
+		if (bake_error(t, &idx, row + 0.25 * rows_per_sample,
+		    tolerance) ||
+		    bake_error(t, &idx, row + 0.5 * rows_per_sample,
+		    tolerance) ||
+		    bake_error(t, &idx, row + 0.75 * rows_per_sample,
+		    tolerance))
+			goto fail;
+	}
+	return 0;
+
+fail:
+	sync_free_bake(t);
+	return -1;
+}
+
+double sync_get_val_baked(const struct sync_track *t, double row)
+{
+	return t->bake ? baked_val(t, row) : sync_get_val(t, row);
+}
+
+size_t sync_key_layout(int num_keys, size_t offsets[4])
+{
+	size_t n = num_keys, size = 0;
+	assert(num_keys >= 0 && n <= sync_max_keys());
+	offsets[0] = size;
+	size += (n * sizeof(int) + KEY_ALIGN - 1) & ~(size_t)(KEY_ALIGN - 1);
+	offsets[1] = size;
+	size += (n * sizeof(float) + KEY_ALIGN - 1) & ~(size_t)(KEY_ALIGN - 1);
+	offsets[2] = size;
+	size += (n + KEY_ALIGN - 1) & ~(size_t)(KEY_ALIGN - 1);
+	offsets[3] = size;
+	size += n * sizeof(struct track_poly);
+	return size;
+}
+
+static void set_key_arrays(struct sync_track *t, char *base, int num_keys)
+{
+	size_t offsets[4];
+	sync_key_layout(num_keys, offsets);
+	t->rows = (int *)(base + offsets[0]);
+	t->values = (float *)(base + offsets[1]);
+	t->types = (unsigned char *)(base + offsets[2]);
+	t->polys = (struct track_poly *)(base + offsets[3]);
+	t->num_keys = num_keys;
+}
+
+int sync_alloc_keys(struct sync_track *t, int num_keys)
+{
+	size_t offsets[4], size = sync_key_layout(num_keys, offsets);
+	char *mem = sync_malloc(t->alloc, size + KEY_ALIGN - 1);
+	if (!mem)
+		return -1;
+
+	t->key_mem = mem;
+	set_key_arrays(t, (char *)(((size_t)mem + KEY_ALIGN - 1) &
+	    ~(size_t)(KEY_ALIGN - 1)), num_keys);
+	t->max_keys = num_keys;
+	return 0;
+}
+
+/* use KEY_ALIGN aligned memory that the track does not own */
+void sync_place_keys(struct sync_track *t, void *mem, int num_keys)
+{
+	set_key_arrays(t, mem, num_keys);
+	t->max_keys = 0;
+	t->mapped = 1;
+}
+
+void sync_free_keys(struct sync_track *t)
+{
+	sync_free_bake(t);
+	if (!t->mapped)
+		sync_free(t->alloc, t->index.buckets);
+	t->mapped = 0;
+	t->index.buckets = NULL;
+	t->index.num_buckets = 0;
+	sync_free(t->alloc, t->key_mem);
+	t->key_mem = NULL;
+	t->rows = NULL;
+	t->values = NULL;
+	t->types = NULL;
+	t->polys = NULL;
+	t->num_keys = t->max_keys = 0;
+
+	sync_free(t->alloc, t->edits);
+	t->edits = NULL;
+	t->num_edits = t->max_edits = 0;
+	t->editing = t->clearing = 0;
+}
+
+/* number of buckets the keys call for, zero if they need no table */
+int sync_index_size(const struct sync_track *t, int *shift)
+{
+	unsigned int span;
+	if (t->num_keys < INDEX_MIN_KEYS)
+		return 0;
+
+	/* aim for about one key per bucket */
+	span = (unsigned int)t->rows[t->num_keys - 1] -
+	    (unsigned int)t->rows[0];
+	for (*shift = 0; (span >> *shift) >= (unsigned int)t->num_keys;
+	    ++*shift)
+		;
+	return (int)(span >> *shift) + 1;
+}
+
+int sync_build_index(struct sync_track *t)
+{
+	int shift, num_buckets;
+	int *buckets;
+
+	sync_free(t->alloc, t->index.buckets);
+	t->index.buckets = NULL;
+	t->index.num_buckets = 0;
+
+	num_buckets = sync_index_size(t, &shift);
+	if (!num_buckets)
+		return 0;
+	buckets = sync_malloc(t->alloc, sizeof(int) * num_buckets);
+	if (!buckets)
+		return -1;
+	sync_place_index(t, buckets, num_buckets, shift);
+	return 0;
+}
+
+/* fill in a table sized by sync_index_size */
+void sync_place_index(struct sync_track *t, int *buckets, int num_buckets,
+    int shift)
+{
+	struct track_index *index = &t->index;
+	int b, i;
+
+	index->buckets = buckets;
+	index->num_buckets = num_buckets;
+	index->first_row = t->rows[0];
+	index->shift = shift;
+	index->num_keys = t->num_keys;
+
+	for (b = 0, i = 0; b < index->num_buckets; ++b) {
+		/* unsigned, the span of the rows may not fit an int */
+		int row = (int)((unsigned int)index->first_row +
+		    ((unsigned int)b << shift));
+		while (i + 1 < t->num_keys && t->rows[i + 1] <= row)
+			i++;
+		index->buckets[b] = i;
 	}
 }
 
@@ -63,14 +612,27 @@ int sync_find_key(const struct sync_track *t, int row)
 {
 	int lo = 0, hi = t->num_keys;
 
-	/* binary search, t->keys is sorted by row */
+	/* narrow down the search range, if the track is indexed */
+	if (t->index.buckets && row >= t->index.first_row) {
+		const struct track_index *index = &t->index;
+		unsigned int b = ((unsigned int)row -
+		    (unsigned int)index->first_row) >> index->shift;
+		if (b < (unsigned int)index->num_buckets) {
+			lo = index->buckets[b];
+			if (b + 1 < (unsigned int)index->num_buckets)
+				hi = index->buckets[b + 1] + 1;
+		} else
+			lo = index->buckets[index->num_buckets - 1];
+	}
+
+	/* binary search, t->rows is sorted */
 	while (lo < hi) {
 		int mi = (lo + hi) / 2;
 		assert(mi != hi);
 
-		if (t->keys[mi].row < row)
+		if (t->rows[mi] < row)
 			lo = mi + 1;
-		else if (t->keys[mi].row > row)
+		else if (t->rows[mi] > row)
 			hi = mi;
 		else
 			return mi; /* exact hit */
@@ -82,40 +644,250 @@ int sync_find_key(const struct sync_track *t, int row)
 }
 
 #ifndef SYNC_PLAYER
+static void move_keys(struct sync_track *dst, int dst_idx,
+    const struct sync_track *src, int src_idx, int count)
+{
+	if (!count)
+		return; /* an empty track has no arrays to pass */
+	memmove(dst->rows + dst_idx, src->rows + src_idx,
+	    sizeof(int) * count);
+	memmove(dst->values + dst_idx, src->values + src_idx,
+	    sizeof(float) * count);
+	memmove(dst->types + dst_idx, src->types + src_idx, count);
+	memmove(dst->polys + dst_idx, src->polys + src_idx,
+	    sizeof(struct track_poly) * count);
+}
+
+static void adopt_keys(struct sync_track *t, const struct sync_track *tmp)
+{
+	sync_free(t->alloc, t->key_mem);
+	t->key_mem = tmp->key_mem;
+	t->rows = tmp->rows;
+	t->values = tmp->values;
+	t->types = tmp->types;
+	t->polys = tmp->polys;
+	t->max_keys = tmp->max_keys;
+}
+
+static int reserve_keys(struct sync_track *t, int num_keys)
+{
+	struct sync_track tmp;
+	if (num_keys <= t->max_keys)
+		return 0;
+
+	/* grow geometrically, to keep appending keys amortized O(1) */
+	if (num_keys < t->max_keys * 2)
+		num_keys = t->max_keys * 2;
+	tmp.alloc = t->alloc;
+	if (sync_alloc_keys(&tmp, num_keys))
+		return -1;
+
+	move_keys(&tmp, 0, t, 0, t->num_keys);
+	adopt_keys(t, &tmp);
+	return 0;
+}
+
+/* copy the keys of a mapped track before modifying them */
+int sync_own_keys(struct sync_track *t)
+{
+	struct sync_track tmp;
+	if (!t->mapped)
+		return 0;
+
+	tmp.alloc = t->alloc;
+	if (sync_alloc_keys(&tmp, t->num_keys))
+		return -1;
+	move_keys(&tmp, 0, t, 0, t->num_keys);
+	adopt_keys(t, &tmp);
+
+	t->mapped = 0;
+	t->index.buckets = NULL;
+	sync_build_index(t);
+	return 0;
+}
+
+/* shift the bucket entries of every bucket that starts at or after row */
+static void update_index(struct sync_track *t, int row, int delta)
+{
+	struct track_index *index = &t->index;
+	unsigned int span;
+	int b;
+
+	/* rebuild when the table is missing or badly sized */
+	if (!index->buckets || row <= index->first_row ||
+	    t->num_keys > index->num_keys * 2 ||
+	    t->num_keys < index->num_keys / 2) {
+		/* the index is optional, a failed rebuild just drops it */
+		if (index->buckets || t->num_keys >= INDEX_MIN_KEYS)
+			sync_build_index(t);
+		return;
+	}
+
+	/* rounded up, and unsigned since the rows may span more than an int */
+	span = (unsigned int)row - (unsigned int)index->first_row;
+	b = (int)((span >> index->shift) +
+	    ((span & ((1u << index->shift) - 1)) != 0));
+	for (; b < index->num_buckets; ++b)
+		index->buckets[b] += delta;
+}
+
+void sync_track_begin_edit(struct sync_track *t)
+{
+	t->editing = 1;
+}
+
+static int queue_edit(struct sync_track *t, const struct track_key *k)
+{
+	if (t->num_edits == t->max_edits) {
+		int max_edits = t->max_edits ? t->max_edits * 2 : 64;
+		void *tmp = sync_realloc(t->alloc, t->edits,
+		    sizeof(struct track_edit) * max_edits);
+		if (!tmp)
+			return -1;
+		t->edits = tmp;
+		t->max_edits = max_edits;
+	}
+	t->edits[t->num_edits].key = *k;
+	t->edits[t->num_edits].seq = t->num_edits;
+	t->num_edits++;
+	return 0;
+}
+
+static int edit_cmp(const void *a, const void *b)
+{
+	const struct track_edit *ea = a, *eb = b;
+	if (ea->key.row != eb->key.row)
+		return ea->key.row < eb->key.row ? -1 : 1;
+	return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+int sync_track_commit_edit(struct sync_track *t)
+{
+	struct sync_track tmp;
+	int i, j, k, n = 0, num_keys = t->clearing ? 0 : t->num_keys;
+
+	t->editing = 0;
+	if (t->clearing && !t->num_edits) {
+		sync_free_keys(t);
+		return 0;
+	}
+	t->clearing = 0;
+	if (!t->num_edits)
+		return 0;
+
+	/* sort by row, and keep only the last edit of each row */
+	for (i = 1; i < t->num_edits; ++i)
+		if (edit_cmp(t->edits + i - 1, t->edits + i) > 0)
+			break;
+	if (i < t->num_edits)
+		qsort(t->edits, t->num_edits, sizeof(struct track_edit),
+		    edit_cmp);
+	for (i = 0; i < t->num_edits; ++i) {
+		if (i + 1 < t->num_edits &&
+		    t->edits[i].key.row == t->edits[i + 1].key.row)
+			continue;
+		t->edits[n++] = t->edits[i];
+	}
+
+	/* merge the edits and the current keys into a new block */
+	tmp.alloc = t->alloc;
+	if (sync_alloc_keys(&tmp, num_keys + n)) {
+		t->num_edits = 0;
+		return -1;
+	}
+	for (i = j = k = 0; i < num_keys || j < n;) {
+		const struct track_key *e = NULL;
+		if (j < n && (i == num_keys ||
+		    t->edits[j].key.row <= t->rows[i])) {
+			e = &t->edits[j++].key;
+			if (i < num_keys && t->rows[i] == e->row)
+				i++; /* replaced or deleted */
+			if (e->type == KEY_TYPE_COUNT)
+				continue;
+			tmp.rows[k] = e->row;
+			tmp.values[k] = e->value;
+			tmp.types[k] = (unsigned char)e->type;
+		} else {
+			tmp.rows[k] = t->rows[i];
+			tmp.values[k] = t->values[i];
+			tmp.types[k] = t->types[i];
+			i++;
+		}
+		k++;
+	}
+	t->num_edits = 0;
+
+	if (t->mapped) {
+		t->mapped = 0;
+		t->index.buckets = NULL;
+	}
+	adopt_keys(t, &tmp);
+	t->num_keys = k;
+
+	sync_update_polys(t, 0, t->num_keys);
+	sync_build_index(t);
+	return 0;
+}
+
+/* drop every key, while editing only when the edits are committed */
+void sync_clear_keys(struct sync_track *t)
+{
+	if (!t->editing) {
+		sync_free_keys(t);
+		return;
+	}
+	t->num_edits = 0; /* the earlier edits go with the keys */
+	t->clearing = 1;
+}
+
 int sync_set_key(struct sync_track *t, const struct track_key *k)
 {
-	int idx = sync_find_key(t, k->row);
+	int idx;
+	if (t->editing)
+		return queue_edit(t, k);
+	if (sync_own_keys(t))
+		return -1;
+
+	idx = sync_find_key(t, k->row);
 	if (idx < 0) {
 		/* no exact hit, we need to allocate a new key */
-		void *tmp;
 		idx = -idx - 1;
-		tmp = realloc(t->keys, sizeof(struct track_key) *
-		    (t->num_keys + 1));
-		if (!tmp)
+		if (reserve_keys(t, t->num_keys + 1))
 			return -1;
+		move_keys(t, idx + 1, t, idx, t->num_keys - idx);
 		t->num_keys++;
-		t->keys = tmp;
-		memmove(t->keys + idx + 1, t->keys + idx,
-		    sizeof(struct track_key) * (t->num_keys - idx - 1));
+		t->rows[idx] = k->row;
+		update_index(t, k->row, 1);
 	}
-	t->keys[idx] = *k;
+	t->values[idx] = k->value;
+	t->types[idx] = (unsigned char)k->type;
+
+	/* the previous segment ends at the new key */
+	sync_update_polys(t, idx - 1, idx + 1);
 	return 0;
 }
 
 int sync_del_key(struct sync_track *t, int pos)
 {
-	void *tmp;
-	int idx = sync_find_key(t, pos);
-	assert(idx >= 0);
-	memmove(t->keys + idx, t->keys + idx + 1,
-	    sizeof(struct track_key) * (t->num_keys - idx - 1));
-	assert(t->keys);
-	tmp = realloc(t->keys, sizeof(struct track_key) *
-	    (t->num_keys - 1));
-	if (t->num_keys != 1 && !tmp)
+	int idx;
+	if (t->editing) {
+		struct track_key k;
+		k.row = pos;
+		k.value = 0.0f;
+		k.type = KEY_TYPE_COUNT;
+		return queue_edit(t, &k);
+	}
+	if (sync_own_keys(t))
 		return -1;
+
+	idx = sync_find_key(t, pos);
+	assert(idx >= 0);
+	move_keys(t, idx, t, idx + 1, t->num_keys - idx - 1);
 	t->num_keys--;
-	t->keys = tmp;
+	update_index(t, pos, -1);
+
+	/* the previous segment now ends at the following key */
+	sync_update_polys(t, idx - 1, idx);
 	return 0;
 }
 #endif
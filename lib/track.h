@@ -1,9 +1,11 @@
 #ifndef SYNC_TRACK_H
 #define SYNC_TRACK_H
 
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include "base.h"
+#include "sync.h"
 
 enum key_type {
 	KEY_STEP,   /* stay constant */
@@ -19,13 +21,109 @@ struct track_key {
 	enum key_type type;
 };
 
+/* cubic in the relative position between a key and the next one */
+struct track_poly {
+	double coeffs[4];
+	double inv_span;
+};
+
+/*
+ * Tracks with many keys get a jump table over their row span. Each bucket
+ * covers (1 << shift) rows and holds the index of the last key at or
+ * before its first row, which narrows the search to a few keys.
+ */
+#define INDEX_MIN_KEYS 1024
+
+struct track_index {
+	int *buckets;
+	int num_buckets;
+	int first_row, shift;
+	int num_keys; /* key count the table was sized for */
+};
+
+/* memory through the device's callbacks, or the C library for NULL */
+static inline void *sync_malloc(const struct sync_alloc_cb *cb, size_t size)
+{
+	return cb ? cb->alloc(size, cb->param) : malloc(size);
+}
+
+static inline void *sync_realloc(const struct sync_alloc_cb *cb, void *ptr,
+    size_t size)
+{
+	return cb ? cb->resize(ptr, size, cb->param) : realloc(ptr, size);
+}
+
+static inline void sync_free(const struct sync_alloc_cb *cb, void *ptr)
+{
+	if (!ptr)
+		return;
+	if (cb)
+		cb->release(ptr, cb->param);
+	else
+		free(ptr);
+}
+
+/* keys are stored as separate, cache-line aligned arrays */
+#define KEY_ALIGN 64
+
 struct sync_track {
 	char *name;
-	struct track_key *keys;
-	int num_keys;
+	uint32_t hash; /* see sync_hash_name */
+	const struct sync_alloc_cb *alloc; /* the device's */
+	int *rows;
+	float *values;
+	unsigned char *types;
+	struct track_poly *polys; /* one per key */
+	struct track_index index;
+	void *key_mem;
+	int num_keys, max_keys;
+	int mapped; /* keys and index are borrowed: a mapping or an arena */
+	int id; /* position in the device's track table */
+	const struct sync_track *volatile snapshot; /* see sync_track_snapshot */
+
+	/* the device version of the last change, and the rows it touched */
+	unsigned long version;
+	unsigned long dirty_since; /* the version before that change */
+	int dirty_start, dirty_end;
+
+	/* the run of rows sync_device_changed_tracks last found */
+	int run_start, run_end;
+	int run_changing; /* the value moves within it */
+	unsigned long run_version;
+
+	/* see sync_bake_keys, samples from bake_start on */
+	float *bake;
+	int bake_count;
+	double bake_start, bake_inv_step;
+
+	/* edits queued between sync_track_begin_edit and commit */
+	struct track_edit *edits;
+	int num_edits, max_edits;
+	int editing;
+	int clearing; /* the current keys go at commit */
 };
 
+/* most keys sync_key_layout can size without overflow, for loaded counts */
+static inline size_t sync_max_keys(void)
+{
+	size_t n = ((size_t)-1 - 4 * KEY_ALIGN) / (sizeof(int) +
+	    sizeof(float) + 1 + sizeof(struct track_poly));
+	return n < INT_MAX ? n : INT_MAX;
+}
+
+size_t sync_key_layout(int, size_t[4]);
+int sync_alloc_keys(struct sync_track *, int);
+void sync_place_keys(struct sync_track *, void *, int);
+void sync_free_keys(struct sync_track *);
+int sync_index_size(const struct sync_track *, int *);
+int sync_build_index(struct sync_track *);
+void sync_place_index(struct sync_track *, int *, int, int);
 int sync_find_key(const struct sync_track *, int);
+void sync_update_polys(struct sync_track *, int, int);
+double sync_get_val_near(const struct sync_track *, int *, double);
+int sync_constant_run(const struct sync_track *, int, int *, int *);
+int sync_bake_keys(struct sync_track *, double, double);
+void sync_free_bake(struct sync_track *);
 static inline int key_idx_floor(const struct sync_track *t, int row)
 {
 	int idx = sync_find_key(t, row);
@@ -35,6 +133,15 @@ static inline int key_idx_floor(const struct sync_track *t, int row)
 }
 
 #ifndef SYNC_PLAYER
+struct track_edit {
+	struct track_key key; /* KEY_TYPE_COUNT deletes the key */
+	int seq;
+};
+
+void sync_track_begin_edit(struct sync_track *);
+int sync_track_commit_edit(struct sync_track *);
+void sync_clear_keys(struct sync_track *);
+int sync_own_keys(struct sync_track *);
 int sync_set_key(struct sync_track *, const struct track_key *);
 int sync_del_key(struct sync_track *, int);
 static inline int is_key_frame(const struct sync_track *t, int row)